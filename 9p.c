@@ -20,33 +20,48 @@
 
 char *filename;
 int devfd;
+uvlong bcachesize = 64*1024*1024;
+uvlong dcachesize = 32*1024*1024;
+uvlong ncachesize = 4*1024*1024;
+uvlong scachesize = 8*1024*1024;
 
 static ulong *crctab;
 void fileread(Req *r);
 
-void loadinodes(inode i, DirEnts *dirents);
 int verifycheck(hammer2_blockref_t *block, void *data);
 char* loadblock(hammer2_blockref_t *block, void *dst, int dstsize, int *rsize);
 
 root_t root;
-
-
-typedef struct{
-	hammer2_tid_t inum;
-	hammer2_blockref_t block;
-} FEntry;
-
-typedef struct fileblocklist fileblocklist_t;
-struct fileblocklist {
-	hammer2_key_t start;
-	hammer2_key_t end;
-
-	hammer2_blockref_t* datablock;
-	fileblocklist_t *next;
+static void initfids(void);
+// The mirror_tid and fsid of the volume header that root was loaded from.
+hammer2_tid_t mounttid;
+uuid_t mountfsid;
+// The sidecar index file, if there is one.
+char *sidecarfile;
+
+enum {
+	// The minimum and maximum number of blocks to read ahead of a file
+	// that's being read sequentially.
+	RAMIN = 2,
+	RAMAX = 32,
+	// The number of procs reading blocks from the disk, and verifying and
+	// decompressing them once they're read.
+	NIOREAD = 4,
+	NIODECODE = 4,
+	// The number of inodes to make room for in the inode index at
+	// startup. It grows as more are looked up.
+	NINODEHINT = 1024,
+	// The number of inodes to cache the attributes of.
+	NATTR = 16384,
+	// The number of names to cache the result of looking up.
+	NNAMES = 16384,
+	// The most free objects to keep around for reuse in each slab.
+	NSLABFREE = 256,
+	NSCRATCHFREE = 16,
+	// How often to check if the volume has changed, in nanoseconds.
+	VOLCHECK = 1000000000,
 };
 
-u64int maxinodes;
-FEntry *inodes;
 
 Qid makeqid(hammer2_tid_t inum, uchar type) {
 	Qid r = {
@@ -57,62 +72,193 @@ Qid makeqid(hammer2_tid_t inum, uchar type) {
 }
 
 
-// Gets a cached FEntry from the list, which must have already had its metadata
-// populated with mkinode
-FEntry* getfentry(Qid q) {
-	if (q.path > maxinodes) {
+// Finds the blockref of the inode inum. If it hasn't been looked up yet, it's
+// found in the sidecar or by descending the PFS root's blockref tree to its
+// inum, and added to the inode index.
+char* findinode(hammer2_tid_t inum, hammer2_blockref_t *block) {
+	Loc l;
+	char *err;
+
+	if (lookinode(inum, &l)) {
+		unpackloc(&l, block);
 		return nil;
 	}
-	return &inodes[q.path];
-}
-
-// Creates an FEntry for an inode and adds it to the cached list.
-FEntry* mkinode(hammer2_tid_t inum, hammer2_blockref_t block){
-	if (inum >= maxinodes) {
-		// FIXME: Be more intelligent about reallocs. We realloc twice
-		// as many to minimize the number of reallocs needed.
-		inodes = realloc(inodes, (inum*2)*sizeof(FEntry));
-		maxinodes = inum*2;
+	if (sidecarinode(inum, block)) {
+		addinode(inum, block);
+		return nil;
+	}
+	err = lookupkey(root.u.blockset.blockref, HAMMER2_SET_COUNT, inum, HAMMER2_BREF_TYPE_INODE, block);
+	if (err != nil) {
+		return err;
 	}
-	FEntry *dir = &inodes[inum];
-	dir->inum = inum;
-	dir->block = block;
-	return dir;
+	addinode(inum, block);
+	return nil;
 }
 
-void fsstart(Srv *) {
+// Finds the PFS named root.pfsname under the superroot of the newest valid
+// volume header and makes it the root.
+static char* loadroot(void) {
 	int i, j;
 	hammer2_dev_t hddev;
-	hammer2_inode_data_t suproot;
-	// FIXME: don't hardcode this;
-	devfd = open(filename, OREAD);
+	hammer2_volume_data_t *vol;
+	hammer2_inode_data_t suproot, pfs;
+	hammer2_blockref_t *pfsblock;
+
 	readvolume(devfd, &hddev);
-	hammer2_volume_data_t vol = hddev.voldata;
+	vol = &hddev.voldata;
 	for(i =0; i < HAMMER2_SET_COUNT; i++) {
-		if (vol.sroot_blockset.blockref[i].type == HAMMER2_BREF_TYPE_INODE) {
-			loadinode(&vol.sroot_blockset.blockref[i], &suproot);
+		if (vol->sroot_blockset.blockref[i].type == HAMMER2_BREF_TYPE_INODE) {
+			loadinode(&vol->sroot_blockset.blockref[i], &suproot);
 			
 			if (suproot.meta.pfs_type == HAMMER2_PFSTYPE_SUPROOT) {
 				// found the superroot, now found the mountable root
 				for(j = 0; j < 4; j++) {
-						if (suproot.u.blockset.blockref[j].type == HAMMER2_BREF_TYPE_INODE) {
-							loadinode(&suproot.u.blockset.blockref[j], &root.inode);
-							if (strcmp(root.pfsname, (char *)root.inode.filename) == 0) {
+						pfsblock = &suproot.u.blockset.blockref[j];
+						if (pfsblock->type == HAMMER2_BREF_TYPE_INODE) {
+							loadinode(pfsblock, &pfs);
+							if (strcmp(root.pfsname, (char *)pfs.filename) == 0) {
+								root.inode = pfs;
 								root.Qid = makeqid(root.meta.inum, QTDIR);
-								maxinodes = suproot.u.blockset.blockref[j].embed.stats.inode_count;
-								inodes = emalloc9p(maxinodes*sizeof(FEntry));
-								root.DirEnts.cap = 0;
-								root.DirEnts.count = 0;
-								mkinode(root.meta.inum, suproot.u.blockset.blockref[j]);
-								loadinodes(root, &root.DirEnts);
-								return;
+								// Other inodes are looked up by
+								// inum when they're needed.
+								addinode(root.meta.inum, pfsblock);
+								mounttid = vol->mirror_tid;
+								mountfsid = vol->fsid;
+								return nil;
 							} 
 						}
 				}
 			}
 		}
 	}
-	sysfatal("Could not find root %s", root.pfsname);
+	return "could not find root";
+}
+
+void fsstart(Srv *) {
+	// FIXME: don't hardcode this;
+	devfd = open(filename, OREAD);
+	// Make the crc table before there's more than one proc that could
+	// race to make it.
+	crctab = mkcrctab(0x82f63b78);
+	inflateinit();
+	initbcache(bcachesize);
+	initdcache(dcachesize);
+	initncache(ncachesize);
+	initio(NIOREAD, NIODECODE);
+	initinodes(NINODEHINT);
+	initattrs(NATTR);
+	initstatcache(scachesize);
+	initnamecache(NNAMES);
+	initscratch(NSCRATCHFREE);
+	initfids();
+	if (loadroot() != nil) {
+		sysfatal("Could not find root %s", root.pfsname);
+	}
+	initsidecar(sidecarfile, &root.inode, &mountfsid, mounttid);
+}
+
+// Serializes checking the volume, so that only one worker asks the disk at a
+// time.
+static struct {
+	QLock;
+	vlong lastcheck;
+	// The last version that couldn't be loaded, which isn't tried again
+	// until the volume changes to another.
+	hammer2_tid_t badtid;
+} volcheck;
+
+// Every request holds the volume read locked while it's being handled, and
+// the volume is write locked while it's reloaded, so that no request sees a
+// half loaded root or puts what it found in the old version into the caches
+// after they've been flushed.
+static RWLock volume;
+
+// Checks whether the volume has been changed since it was mounted, at most
+// once every VOLCHECK nanoseconds. If its mirror_tid has moved on, everything
+// that was cached from the old version is thrown away and the root is loaded
+// again. Must not be called with the volume locked.
+void checkvolume(void) {
+	hammer2_tid_t tid;
+	vlong now;
+	char *err;
+
+	// Nearly every request gets here, so don't make them all queue up
+	// just to find that it's not time yet. A stale lastcheck only means
+	// we look at the lock.
+	now = nsec();
+	if (now - volcheck.lastcheck < VOLCHECK) {
+		return;
+	}
+	// If someone else is checking, it'll be done by the time it matters.
+	if (!canqlock(&volcheck)) {
+		return;
+	}
+	if (now - volcheck.lastcheck < VOLCHECK) {
+		qunlock(&volcheck);
+		return;
+	}
+	volcheck.lastcheck = now;
+	tid = volumetid(devfd);
+	if (tid == 0 || tid == mounttid || tid == volcheck.badtid) {
+		qunlock(&volcheck);
+		return;
+	}
+	fprint(2, "volume changed (mirror_tid %ulld to %ulld), flushing caches\n", mounttid, tid);
+	wlock(&volume);
+	dropsidecar();
+	flushattrs();
+	flushstatcache();
+	flushnamecache();
+	clearinodes();
+	flushcaches();
+	err = loadroot();
+	if (err != nil) {
+		fprint(2, "%s\n", err);
+		volcheck.badtid = tid;
+	} else {
+		initsidecar(sidecarfile, &root.inode, &mountfsid, mounttid);
+	}
+	wunlock(&volume);
+	qunlock(&volcheck);
+}
+
+// Called around every request, and not nested.
+void beginreq(void) {
+	checkvolume();
+	rlock(&volume);
+}
+
+void endreq(void) {
+	runlock(&volume);
+}
+
+// A walked to inode, shared by every fid that's on it because it walked
+// there or was cloned from one that did. It's freed when the last of them is
+// clunked. The root's inode is never freed, so fids on the root don't have
+// one.
+typedef struct Ino Ino;
+struct Ino {
+	Ref;
+	inode;
+};
+
+// Walks and clones happen all the time, so their inodes and Aux come from
+// slabs.
+static Slab inoslab;
+static Slab auxslab;
+
+static Ino* newino(void) {
+	Ino *i;
+
+	i = slaballoc(&inoslab);
+	memset(i, 0, sizeof(Ino));
+	incref(i);
+	return i;
+}
+
+static void putino(Ino *i) {
+	if (i != nil && decref(i) == 0)
+		slabfree(&inoslab, i);
 }
 
 typedef struct Aux Aux;
@@ -121,6 +267,7 @@ struct Aux {
 	RWLock;
 	// The currently walked to inode
 	hammer2_inode_data_t *inode;
+	Ino *ino;
 
 	// If loading an indirect block, the parent is an Aux structure
 	// that caused this indirection.
@@ -138,23 +285,88 @@ struct Aux {
 			vlong lastbufoffset;
 			int lastbufcount;
 
-			fileblocklist_t *datablocks;
+			BlockMap datablocks;
+
+			// Readahead state. nextoff is where the next read
+			// will be if the file is being read sequentially,
+			// rawindow is the number of blocks to read ahead, and
+			// raend is the end of what has already been read
+			// ahead.
+			vlong nextoff;
+			int rawindow;
+			hammer2_key_t raend;
 		} file;
 
-		DirEnts dir;
+		// The directory read cursor. Entries are read in key
+		// order, and pos is the key to resume reading from at
+		// offset off.
+		struct {
+			hammer2_key_t pos;
+			vlong off;
+			int eof;
+			// The directory's packed entries from the stat
+			// cache, shared with every other fid reading it.
+			StatDir *sd;
+			// The directory is too big for the stat cache.
+			int big;
+		} dir;
 	} cache;
 };
 
+static void initfids(void) {
+	initslab(&inoslab, "inode", sizeof(Ino), NSLABFREE);
+	initslab(&auxslab, "aux", sizeof(Aux), NSLABFREE);
+}
+
+// Moves the directory read cursor of a back to the start.
+static void resetdir(Aux *a) {
+	if (a->cache.dir.sd != nil)
+		putstatdir(a->cache.dir.sd);
+	a->cache.dir.sd = nil;
+	a->cache.dir.pos = HAMMER2_DIRHASH_VISIBLE;
+	a->cache.dir.off = 0;
+	a->cache.dir.eof = 0;
+	a->cache.dir.big = 0;
+}
+
+// Releases the directory listing or file block map a holds for the fid on
+// qid q.
+static void freecache(Aux *a, Qid q) {
+	switch(q.type) {
+	case QTDIR:
+		if (a->cache.dir.sd != nil)
+			putstatdir(a->cache.dir.sd);
+		break;
+	case QTFILE:
+		freeblockmap(&a->cache.file.datablocks);
+		putscratch(a->cache.file.lastbuf);
+		break;
+	}
+	memset(&a->cache, 0, sizeof(a->cache));
+}
+
+void fsdestroyfid(Fid *fid) {
+	Aux *a = fid->aux;
+
+	if (a == nil) {
+		return;
+	}
+	freecache(a, fid->qid);
+	putino(a->ino);
+	slabfree(&auxslab, a);
+}
+
 void fsattach(Req *r) {
 	Aux *a;
-	a = emalloc9p(sizeof(Aux));
+	a = slaballoc(&auxslab);
+	memset(a, 0, sizeof(Aux));
 	a->inode = &root.inode;
 	a->parent = nil;
 	a->blocks = &(root.u.blockset.blockref[0]);
 	a->offset = 0;
 	a->count = 4;
 
-	a->cache.dir = root.DirEnts;
+	resetdir(a);
 
 	a->Qid = root.Qid;
 	r->fid->qid = root.Qid;
@@ -163,111 +375,20 @@ void fsattach(Req *r) {
 	respond(r, nil);
 }
 
-// Load all the inodes stored under i into the inodes array
-void loadinodes(inode i, DirEnts *dirents) {
-	Aux orig;
-	Aux *cur;
-
-	orig.parent = nil;
-	orig.inode = &i;
-	orig.blocks = &i.u.blockset.blockref[0];
-	orig.offset = 0;
-	orig.count = 4;
-	cur = &orig;
-
-start:
-	while(cur->offset >= cur->count) {
-		if (cur->parent == nil) {
-			return;
-		}
-		Aux *tmp = cur;
-		cur = cur->parent;
-		free(tmp->blocks);
-		free(tmp);
-	}
-
-	hammer2_blockref_t *block = &cur->blocks[cur->offset];
-
-	// Things for indirect blocks.
-	int radix;
-	int dsize;
-	int indblocks;
-	Aux *tmp;
-	char *err;
-	switch (block->type) {
-	case HAMMER2_BREF_TYPE_INODE: 
-		mkinode(block->key, *block);
-		cur->offset++;
-		goto start;
-	case HAMMER2_BREF_TYPE_EMPTY:
-		cur->offset++;
-		goto start;
-	case HAMMER2_BREF_TYPE_DIRENT:
-		if (dirents != nil) {
-			if (dirents->cap == 0) {
-				// Arbitrarily start with enough space for 16
-				// directories.
-				dirents->cap = 16;
-				dirents->entry = emalloc9p(sizeof(hammer2_blockref_t)*16);
-			} else if (dirents->cap == dirents->count) {
-				dirents->cap *= 2;
-				dirents->entry = erealloc9p(dirents->entry, dirents->cap*sizeof(hammer2_blockref_t));
-			}
-			dirents->entry[dirents->count++] = *block;
-		}
-		cur->offset++;
-		goto start;
-	case HAMMER2_BREF_TYPE_INDIRECT:
-		radix = block->data_off & HAMMER2_OFF_MASK_RADIX;
-		dsize = 1<<radix;
-		indblocks = dsize / sizeof(hammer2_blockref_t);
-		if (radix == 0) {
-			sysfatal("No radix");
-		}
-		
-		cur->offset++;
-		tmp = cur;
-
-		cur = emalloc9p(sizeof(Aux));
-
-		cur->inode = &i;
-		cur->parent = tmp;
-		cur->blocks = emalloc9p(HAMMER2_PBUFSIZE);
-		assert(cur->blocks != nil);
-		cur->offset = 0;
-		cur->count = indblocks;
+// Fills in the qid, mode, times, length and name of dir from the directory
+// entry block and the attributes of the inode it points to. The name is
+// allocated and must be freed by the caller. Returns -1 if the inode couldn't
+// be loaded.
+int direntstat(hammer2_blockref_t *block, Dir *dir) {
+	Attr at;
+	char namedata[HAMMER2_INODE_MAXNAME+1];
 
-		// Load the data from disk and start again at the new level
-		// of indirection.
-		err = loadblock(block, cur->blocks, dsize, nil);
-		if (err != nil) {
-			fprint(2, "loading err: %s\n", err);
-		}	
-		goto start;
-	default:
-		// For now assume if we got here something went wrong.
-		printf("Type %d\n", block->type);
-		sysfatal("Unhandled block type in directory");
-	}
-}
-
-int cacheddirread(int n, Dir *dir, void *aux) {
-	Aux *a = aux;
-	if (n < 0 || n >= a->cache.dir.count) {
+	dir->qid = makeqid(block->embed.dirent.inum, 0);
+	if (getattr(block->embed.dirent.inum, &at) != nil) {
 		return -1;
 	}
 
-	hammer2_blockref_t block = a->cache.dir.entry[n];
-
-	dir->qid = makeqid(block.embed.dirent.inum, 0);
-	FEntry *f = getfentry(dir->qid);
-	if (f == nil) {
-		sysfatal("could not load inode");
-	}
-
-	inode i;
-	loadinode(&f->block, &i);
-	switch (i.meta.type) {
+	switch (at.type) {
 		case HAMMER2_OBJTYPE_DIRECTORY:
 			dir->qid.type = QTDIR;
 			break;
@@ -276,96 +397,119 @@ int cacheddirread(int n, Dir *dir, void *aux) {
 			dir->qid.type = QTFILE;
 			break;
 		default:
-			printf("type %d\n", i.meta.type);
+			printf("type %d\n", at.type);
 			sysfatal("Unhandled OBJTYPE");
 	}
-	dir->mode = i.meta.mode;
+	dir->mode = at.mode;
 	if (dir->qid.type == QTDIR){
 		dir->mode |= DMDIR;
 	}
-	dir->atime = i.meta.atime / 1000000; // unsupported.
-	dir->mtime = i.meta.mtime / 1000000; // hammer2 is nanoseconds, 9p is seconds
-	dir->length = i.meta.size;
-	if (block.embed.dirent.namlen <= 64)
-		dir->name = estrdup9p(block.check.buf);
-	else {
-		char *err;
-		char data[HAMMER2_BLOCKREF_LEAF_MAX+1];
-		int size;
-		err = loadblock(&block, data, HAMMER2_BLOCKREF_LEAF_MAX, &size);
-		if (err != nil){
-			fprint(2, "%s\n", err);
-		}
-		dir->name = estrdup9p(data);
-	}
-
-	// FIXME: Get from uid/gid from inode and parse /etc/passwd (
-	// 	or add an /adm/users?)
-	dir->uid = estrdup9p(getuser());
-	dir->gid = estrdup9p(getuser());
+	dir->atime = at.atime / 1000000; // unsupported.
+	dir->mtime = at.mtime / 1000000; // hammer2 is nanoseconds, 9p is seconds
+	dir->length = at.size;
+	dir->name = estrdup9p(direntname(block, namedata));
 	return 0;
 }
 
+typedef struct {
+	char *name;
+	int len;
+
+	int found;
+	hammer2_blockref_t block;
+} DirLookup;
+
+static void matchdirent(hammer2_blockref_t *block, void *aux) {
+	DirLookup *l = aux;
+	char namedata[HAMMER2_INODE_MAXNAME+1];
+
+	if (l->found || block->type != HAMMER2_BREF_TYPE_DIRENT) {
+		return;
+	}
+	if (block->embed.dirent.namlen != l->len) {
+		return;
+	}
+	if (strcmp(l->name, direntname(block, namedata)) == 0) {
+		l->found = 1;
+		l->block = *block;
+	}
+}
+
+// Finds name in the directory a is walked to, in the sidecar if it has the
+// directory, or else by comparing the entries whose key is in the collision
+// range of name's dirhash. The result is kept in the name cache whether or
+// not it was found.
 Qid loadsubdir(Aux *a, char *name) {
-	int i;
 	Qid r; 
-	char namedata[HAMMER2_BLOCKREF_LEAF_MAX+1];
-	for(i=0; i < a->cache.dir.count; i++){
-		char *ename;
-		hammer2_blockref_t block = a->cache.dir.entry[i];
-		if (block.embed.dirent.namlen > 64) {
-			char *err;
-			int size;
-			err = loadblock(&block, namedata, HAMMER2_BLOCKREF_LEAF_MAX, &size);
-			if (err != nil){
-				fprint(2, "%s\n", err);
-			}
-			ename = namedata;
-		} else {
-			ename = block.check.buf;
-		}
+	DirLookup l;
+	hammer2_key_t key;
+	hammer2_tid_t parent, inum;
+	uchar type;
+	char *err;
 
-		if (strcmp(name, ename) == 0) {
-			inode in;
-			FEntry *fe;
-			r = makeqid(block.embed.dirent.inum, 0);
-			fe = getfentry(r);
-			if (fe == nil) {
-				sysfatal("could not load inode");
-			}
-			loadinode(&fe->block, &in);
-			switch (in.meta.type) {
-			case HAMMER2_OBJTYPE_DIRECTORY:
-				r.type = QTDIR;
-				return r;
-			case HAMMER2_OBJTYPE_REGFILE:
-			case HAMMER2_OBJTYPE_SOFTLINK:
-				r.type = QTFILE;
-				return r;
-			default:
-				printf("%s type %d\n", name, in.meta.type);
-				sysfatal("Unhandled OBJTYPE");
-			}
+	parent = a->inode->meta.inum;
+	if (looknamecache(parent, name, &r)) {
+		return r;
+	}
+
+	err = nil;
+	if (!sidecarlookup(parent, name, &inum, &type)) {
+		l.name = name;
+		l.len = strlen(name);
+		l.found = 0;
+		key = dirhash(name, l.len);
+		err = scankeys(a->inode->u.blockset.blockref, HAMMER2_SET_COUNT, key, key + HAMMER2_DIRHASH_LOMASK, matchdirent, &l);
+		if (err != nil) {
+			fprint(2, "%s\n", err);
+		}
+		inum = 0;
+		if (l.found) {
+			inum = l.block.embed.dirent.inum;
+			type = l.block.embed.dirent.type;
+		}
+	}
+	if (inum != 0) {
+		r = makeqid(inum, 0);
+		switch (type) {
+		case HAMMER2_OBJTYPE_DIRECTORY:
+			r.type = QTDIR;
+			break;
+		case HAMMER2_OBJTYPE_REGFILE:
+		case HAMMER2_OBJTYPE_SOFTLINK:
+			r.type = QTFILE;
+			break;
+		default:
+			printf("%s type %d\n", name, type);
+			sysfatal("Unhandled OBJTYPE");
 		}
+		addnamecache(parent, name, r);
+		return r;
 	}
 	r.path = 0;
 	r.vers = 0;
 	r.type = 0;
+	if (err == nil) {
+		// Only remember that it isn't there if we're sure.
+		addnamecache(parent, name, r);
+	}
 	return r;
 }
 
-char* fswalk(Fid *fid, char *name, Qid *qid) {
-	Aux *a;
+// Walks fid, whose Aux a is wlocked, to name.
+static char* walkaux(Fid *fid, Aux *a, char *name, Qid *qid) {
 	Qid q;
-	a = fid->aux;
+
 	if (strcmp(name, "/") == 0) {
+		freecache(a, fid->qid);
+		putino(a->ino);
+		a->ino = nil;
 		fid->qid = root.Qid;
 		a->inode = &root.inode;
 		a->parent = nil;
 		a->blocks = &(root.u.blockset.blockref[0]);
 		a->offset = 0;
 		a->count = 4;
-		a->cache.dir = root.DirEnts;
+		resetdir(a);
 		*qid = root.Qid;
 		return nil;
 	} else if (strcmp(name, "..") == 0) {
@@ -381,11 +525,19 @@ char* fswalk(Fid *fid, char *name, Qid *qid) {
 			return "not found";
 		}
 	}
-	FEntry *fe = getfentry(q);
+	hammer2_blockref_t iblock;
+	if (findinode(q.path, &iblock) != nil) {
+		return "not found";
+	}
 
-	a->inode = emalloc9p(sizeof(inode));
+	Ino *ino = newino();
+	loadinode(&iblock, &ino->inode);
 
-	loadinode(&fe->block, a->inode);
+	// Let go of whatever we were on before.
+	freecache(a, fid->qid);
+	putino(a->ino);
+	a->ino = ino;
+	a->inode = &ino->inode;
 
 	a->parent = nil;
 	a->blocks = &(a->inode->u.blockset.blockref[0]);
@@ -393,14 +545,12 @@ char* fswalk(Fid *fid, char *name, Qid *qid) {
 	a->count = 4;
 	switch(q.type){
 	case QTDIR:
-		a->cache.dir.cap = 0;
-		a->cache.dir.count = 0;
-		a->cache.dir.entry = nil;
-		loadinodes(*a->inode, &a->cache.dir);
+		// The entries aren't looked at until the directory is
+		// read, so walking through it costs nothing.
+		resetdir(a);
 		break;
 	case QTFILE:
-		a->cache.file.lastbuf = nil;
-		a->cache.file.lastbufcount = 0;
+		// freecache has already cleared the read state.
 		break;
 	default:
 		return "unhandled qid type";
@@ -411,145 +561,61 @@ char* fswalk(Fid *fid, char *name, Qid *qid) {
 	return nil;
 }
 
+char* fswalk(Fid *fid, char *name, Qid *qid) {
+	Aux *a;
+	char *err;
+
+	a = fid->aux;
+	wlock(a);
+	err = walkaux(fid, a, name, qid);
+	wunlock(a);
+	return err;
+}
+
 char* fswalkclone(Fid *old, Fid *new) {
-	// FIXME: Fix memory leak by implementing destroy.
 	Aux *oaux = old->aux;
-	Aux *naux = emalloc9p(sizeof(Aux));
+	Aux *naux = slaballoc(&auxslab);
 	new->aux = naux;
+	rlock(oaux);
 	memcpy(naux, oaux, sizeof(Aux));
-
-	// Cache can be freed behind our back, so don't reuse it.
-	int bsize;
-	switch (old->qid.type){
-	case QTDIR:
-		// We don't leave extra capacity since we know how many entries
-		// are in the directory and it's unlikely to change.
-		bsize = oaux->cache.dir.count*sizeof(hammer2_blockref_t);
-		naux->cache.dir.cap = oaux->cache.dir.count;
-		naux->cache.dir.count = oaux->cache.dir.count;
-		memcpy(naux->cache.dir.entry, oaux->cache.dir.entry, bsize);
-		break;
-	case QTFILE:
-		naux->cache.file.lastbuf = nil;
-		naux->cache.file.lastbufcount = 0;
-		break;
+	memset(&naux->RWLock, 0, sizeof(RWLock));
+	if (naux->ino != nil)
+		incref(naux->ino);
+	if (old->qid.type == QTDIR && naux->cache.dir.sd != nil)
+		dupstatdir(naux->cache.dir.sd);
+	runlock(oaux);
+
+	// A directory's listing is immutable, so the new fid shares it, but
+	// a file's block map and last block are per fid, so start over.
+	if (old->qid.type == QTFILE) {
+		memset(&naux->cache.file, 0, sizeof(naux->cache.file));
+		initblockmap(&naux->cache.file.datablocks, naux->inode);
 	}
 	return nil;
 }
 
-typedef struct fileblocklist fileblocklist_t;
-
-fileblocklist_t* loaddatablocklist(inode *in) {
-	fileblocklist_t* headn = nil;
-	fileblocklist_t* curn = nil;
-	if (in->meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA) {
-		return nil;
-	}
-
-	Aux *orig = emalloc9p(sizeof(Aux));
-	Aux *cur;
-	orig->parent = nil;
-
-	// Make a copy of the blockset so that we don't can just assume that
-	// everything needs to be freed in the end.
-	orig->blocks = emalloc9p(sizeof(hammer2_blockset_t));
-	memcpy(orig->blocks, &in->u.blockset, sizeof(hammer2_blockset_t));
-	orig->offset = 0;
-	orig->count = 4;
-	cur = orig;
-
-
-	Aux *tmp;
-	char *err;
-	int nbytes;
-	int radix;
-	int chksize;
-
-	while(cur != nil){
-nextlevel:
-		for(int i = cur->offset; i < cur->count; i++) {
-			// save i at the next block for the next indirection level
-			// to pick up where we left off when there's an indirect
-			// block.
-			// at the same place.
-			cur->offset = i+1;
-
-			hammer2_blockref_t *block = &cur->blocks[i];
-
-			switch(block->type){
-			case HAMMER2_BREF_TYPE_DATA:
-				// add a new fileblocklist_t to the end of the
-				// list with the current block.
-				if(headn == nil) {
-					headn = emalloc9p(sizeof(fileblocklist_t));
-					curn = headn;
-				} else {
-					curn->next = emalloc9p(sizeof(fileblocklist_t));
-					curn = curn->next;
-				}
-				curn->next = nil;
-				curn->start = block->key;
-				curn->end = block->key + (1<<block->keybits);
-				if(curn->end > in->meta.size){
-					curn->end  = in->meta.size;
-				}
-
-				// Make a copy so that this indirection level (including
-				// any empty or indirect ones that we don't care about
-				// after our list is complete) can be freed when we.
-				// exit.
-				curn->datablock = emalloc9p(sizeof(hammer2_blockref_t));
-				memcpy(curn->datablock, block, sizeof(hammer2_blockref_t));
-
-				break;
-			case HAMMER2_BREF_TYPE_INDIRECT:
-				tmp = cur;
-				cur = emalloc9p(sizeof(Aux));
-				cur->parent = tmp;
-
-				cur->blocks = emalloc9p(HAMMER2_PBUFSIZE);
-				cur->offset = 0;
-
-				radix = block->data_off & HAMMER2_OFF_MASK_RADIX;
-				chksize = 1<<radix;
-				cur->count = chksize / sizeof(hammer2_blockref_t);
-
-				err = loadblock(block, cur->blocks, chksize, &nbytes);
-				if(err != nil){
-					sysfatal(err);
-				}
-				goto nextlevel;
-			case HAMMER2_BREF_TYPE_EMPTY:
-				// don't care
-				break;
-			default:
-				sysfatal("Unhandled BREF type while loading file");
-			}
-		}
-
-		tmp = cur;
-		cur = cur->parent;
-
-		free(tmp->blocks);
-		free(tmp);
-	}
-	return headn;
-}
-
 void fsopen(Req *r) {
 	Aux *a = r->fid->aux;
-	if (r->fid->qid.path == root.Qid.path) {
-		a->cache.dir = root.DirEnts;
+	wlock(a);
+	if (r->fid->qid.type == QTDIR){
+		resetdir(a);
 	}
 	if (r->fid->qid.type == QTFILE){
 		inode *i = a->inode;
 		if (i->meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA) {
 			// Nothing, content is embedded in inode
 		} else {
-			a->cache.file.datablocks = loaddatablocklist(i);
+			// Blocks are looked up as they're read, so that
+			// opening a large file doesn't need to read all of its
+			// indirect blocks.
+			initblockmap(&a->cache.file.datablocks, i);
 		}
 
 	}
+	wunlock(a);
+	// Reads are filled across as many blocks as they cover, so let
+	// clients ask for as much as fits in a message.
+	r->ofcall.iounit = r->srv->msize - IOHDRSZ;
 	respond(r, nil);
 }
 	
@@ -564,35 +630,199 @@ void fsstat(Req *r) {
 		respond(r, nil);
 		return;
 	}
-	FEntry *f = getfentry(r->fid->qid);
-	if (f == nil) {
+	Attr at;
+	if (getattr(r->fid->qid.path, &at) != nil) {
 		respond(r, "not found");
 		return;
 	}
 
-	inode i;
-	loadinode(&f->block, &i);
 	r->d.qid = r->fid->qid;
-	r->d.mode = i.meta.mode;
+	r->d.mode = at.mode;
 	if (r->fid->qid.type == QTDIR){
 		r->d.mode |= DMDIR;
 	}
-	r->d.atime = i.meta.atime / 1000000;
-	r->d.mtime = i.meta.mtime / 1000000;
-	r->d.length = i.meta.size;
+	r->d.atime = at.atime / 1000000;
+	r->d.mtime = at.mtime / 1000000;
+	r->d.length = at.size;
 	r->d.uid = estrdup9p(getuser());
 	r->d.gid = estrdup9p(getuser());
 
 	respond(r, nil);
 }
 
+// Fills in a directory read by copying the entries it asks for out of the
+// directory's packed stat entries in the stat cache, and moves the cursor past
+// them. Returns 0 if the directory is too big for the stat cache, or 1 with
+// *errp set if the read failed.
+static int statdirread(Req *r, char **errp) {
+	Aux *a = r->fid->aux;
+	StatDir *d;
+	vlong off;
+	int lo, hi, mid, i;
+
+	d = a->cache.dir.sd;
+	if (d == nil) {
+		// Hold on to it until the fid is done with the directory.
+		d = getstatdir(r->fid->qid.path, a->inode);
+		if (d == nil) {
+			a->cache.dir.big = 1;
+			return 0;
+		}
+		a->cache.dir.sd = d;
+	}
+	off = r->ifcall.offset;
+	if (off >= d->size) {
+		a->cache.dir.eof = 1;
+		r->ofcall.count = 0;
+		return 1;
+	}
+	// Find the entry that starts at off.
+	lo = 0;
+	hi = d->count;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if (d->offs[mid] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (d->offs[lo] != off) {
+		*errp = "bad offset in directory read";
+		return 1;
+	}
+	for(i = lo; i < d->count && d->offs[i+1] - off <= r->ifcall.count; i++)
+		;
+	r->ofcall.count = d->offs[i] - off;
+	memcpy(r->ofcall.data, d->data + off, r->ofcall.count);
+	// Keep the cursor in step with the listing, so that either way of
+	// reading can carry on from here.
+	if (i < d->count)
+		a->cache.dir.pos = d->keys[i];
+	else
+		a->cache.dir.eof = 1;
+	a->cache.dir.off = off + r->ofcall.count;
+	return 1;
+}
+
+typedef struct {
+	hammer2_blockref_t *ents;
+	int count;
+	int max;
+} DirBatch;
+
+static int batchdirent(hammer2_blockref_t *block, void *aux) {
+	DirBatch *b = aux;
+
+	if (block->type != HAMMER2_BREF_TYPE_DIRENT) {
+		return 1;
+	}
+	b->ents[b->count++] = *block;
+	return b->count < b->max;
+}
+
+// Fills in a directory read by scanning the directory from the cursor for as
+// many entries as the read could hold, and packing as many of them as fit.
+// Only the entries for this read are ever in memory, so reading a directory
+// with millions of entries doesn't need to hold all of them.
+static char* streamdirread(Req *r) {
+	Aux *a = r->fid->aux;
+	DirBatch b;
+	Arena ar;
+	Dir dir;
+	hammer2_tid_t *inums;
+	char *user, *err;
+	long done;
+	int i, n, more;
+
+	if (a->cache.dir.eof) {
+		r->ofcall.count = 0;
+		return nil;
+	}
+	// Every entry takes at least STATFIXLEN bytes, so this is as many as
+	// the read could possibly hold.
+	b.max = r->ifcall.count / STATFIXLEN;
+	if (b.max == 0) {
+		return "read too small for directory entry";
+	}
+	initarena(&ar);
+	b.ents = arenaalloc(&ar, b.max*sizeof(hammer2_blockref_t));
+	b.count = 0;
+	err = scanfrom(a->inode->u.blockset.blockref, HAMMER2_SET_COUNT, a->cache.dir.pos, batchdirent, &b);
+	if (err != nil) {
+		freearena(&ar);
+		return err;
+	}
+	// If the batch filled up there may be more after it.
+	more = b.count == b.max;
+
+	// Load the batch's inodes all at once in disk order.
+	inums = arenaalloc(&ar, b.max*sizeof(hammer2_tid_t));
+	for(i = 0; i < b.count; i++)
+		inums[i] = b.ents[i].embed.dirent.inum;
+	prefetchattrs(inums, b.count);
+
+	// FIXME: Get from uid/gid from inode and parse /etc/passwd (
+	// 	or add an /adm/users?)
+	user = getuser();
+	done = 0;
+	err = nil;
+	for(i = 0; i < b.count; i++) {
+		memset(&dir, 0, sizeof(Dir));
+		if (direntstat(&b.ents[i], &dir) < 0) {
+			err = "could not load inode";
+			break;
+		}
+		dir.uid = user;
+		dir.gid = user;
+		n = sizeD2M(&dir);
+		if (done + n > r->ifcall.count) {
+			free(dir.name);
+			break;
+		}
+		convD2M(&dir, (uchar*)r->ofcall.data + done, n);
+		free(dir.name);
+		done += n;
+	}
+	if (i < b.count)
+		a->cache.dir.pos = b.ents[i].key;
+	else if (more)
+		a->cache.dir.pos = b.ents[b.count-1].key + 1;
+	else
+		a->cache.dir.eof = 1;
+	freearena(&ar);
+	if (done == 0 && err != nil) {
+		return err;
+	}
+	a->cache.dir.off += done;
+	r->ofcall.count = done;
+	return nil;
+}
+
 void fsread(Req *r) {
+	Aux *a;
+	char *err;
+
 	switch(r->fid->qid.type) {
 	case QTDIR:
-		// Walking to the dir should have cached the dirents in
-		// fid->aux.cache.dir
-		dirread9p(r, cacheddirread, r->fid->aux);
-		break;
+		// The cursor moves with every read, so directory reads on a
+		// fid are one at a time.
+		a = r->fid->aux;
+		wlock(a);
+		if (r->ifcall.offset == 0) {
+			resetdir(a);
+		} else if (r->ifcall.offset != a->cache.dir.off) {
+			wunlock(a);
+			respond(r, "bad offset in directory read");
+			return;
+		}
+		err = nil;
+		if (a->cache.dir.big || !statdirread(r, &err)) {
+			err = streamdirread(r);
+		}
+		// The fid can be clunked as soon as we respond.
+		wunlock(a);
+		respond(r, err);
+		return;
 	case QTFILE:
 		fileread(r);
 		return;
@@ -603,45 +833,60 @@ void fsread(Req *r) {
 	respond(r, nil);
 }
 
-void fileread(Req *r) {
-	Aux *a = r->fid->aux;
-	// Reading at/past EOF.
-	if (r->ifcall.offset == a->inode->meta.size) {
-		r->ofcall.count = 0;
-		respond(r, nil);
-		return;
-	} else if(r->ifcall.offset > a->inode->meta.size) {
-		r->ofcall.count = -1;
-		respond(r, "read past end of file");
-		return;
+// Adjusts the readahead window of a when a read misses lastbuf and needs to
+// load cur, and starts loading the blocks after cur in the background if the
+// file is being read sequentially. The window doubles
+// every time a sequential read crosses into a new block and halves every time
+// a read doesn't continue where the last one left off. Must be called with a
+// wlocked.
+static void readaheadfile(Aux *a, Extent *cur, int sequential) {
+	BlockMap *m = &a->cache.file.datablocks;
+	hammer2_blockref_t block;
+	hammer2_key_t off, holeend;
+	int i, idx;
+
+	if (sequential) {
+		if (a->cache.file.rawindow == 0)
+			a->cache.file.rawindow = RAMIN;
+		else if (a->cache.file.rawindow < RAMAX)
+			a->cache.file.rawindow *= 2;
+	} else {
+		a->cache.file.rawindow /= 2;
+		a->cache.file.raend = 0;
 	}
-
-	// If data is stored in the inode, don't bother getting anything from
-	// disk.
-	if (a->inode->meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA) {
-		assert(a->inode->meta.size > r->ifcall.offset);
-		assert(r->ifcall.offset < HAMMER2_EMBEDDED_BYTES);
-		int size = a->inode->meta.size - r->ifcall.offset;
-		memcpy(r->ofcall.data, (void *)&a->inode->u.data[r->ifcall.offset], size);
-		r->ofcall.count = size;
-		respond(r, nil);
-		return;
+	off = cur->end;
+	for(i = 0; i < a->cache.file.rawindow && off < a->inode->meta.size; i++) {
+		// This maps any blocks after the ones we know about, so that
+		// readahead can continue into the next indirect block.
+		if (mapoffset(m, off, &idx, &holeend) != nil) {
+			break;
+		}
+		if (idx < 0) {
+			off = holeend;
+			continue;
+		}
+		if (m->ext[idx].start >= a->cache.file.raend) {
+			unpackloc(&m->ext[idx].datablock, &block);
+			prefetch(&block);
+			a->cache.file.raend = m->ext[idx].end;
+		}
+		off = m->ext[idx].end;
 	}
+}
 
+// Reads up to count bytes at offset into dst from the one data block or hole
+// that offset is in. Returns the number of bytes read, or -1 with errp set if
+// the block couldn't be loaded.
+static long fileblockread(Aux *a, uchar *dst, long count, vlong offset, int sequential, char **errp) {
 	// Check if it's in the data read from the last block before doing
 	// anything.
 	rlock(a);
 	if (a->cache.file.lastbufcount > 0 
-		&& r->ifcall.offset >= a->cache.file.lastbufoffset 
-		&& r->ifcall.offset < a->cache.file.lastbufcount + a->cache.file.lastbufoffset
+		&& offset >= a->cache.file.lastbufoffset 
+		&& offset < a->cache.file.lastbufcount + a->cache.file.lastbufoffset
 	){
 		// It's still cached from the last read, so just copy it from memory.
-		int count = r->ifcall.count;
-		int offstart = r->ifcall.offset - a->cache.file.lastbufoffset;
-		if (count + r->ifcall.offset > a->inode->meta.size) {
-			// Ensure we don't send past EOF.
-			count = a->inode->meta.size - r->ifcall.offset;
-		}
+		int offstart = offset - a->cache.file.lastbufoffset;
 		if (count + offstart > a->cache.file.lastbufcount) {
 			// We can only send as many bytes as are in lastbuf.
 			count = a->cache.file.lastbufcount - offstart;
@@ -649,74 +894,126 @@ void fileread(Req *r) {
 		assert(count > 0);
 		assert(offstart + count <= a->cache.file.lastbufcount);
 
-		memcpy(r->ofcall.data, (uchar *)&a->cache.file.lastbuf[offstart],count);
+		memcpy(dst, (uchar *)&a->cache.file.lastbuf[offstart],count);
 		runlock(a);
-		r->ofcall.count = count;
-		respond(r, nil);
-		return;
+		return count;
 	}
 	runlock(a);
 
-	hammer2_blockref_t *block = nil;
-
-	// for autozero
-	fileblocklist_t *cur;
-	hammer2_key_t nearest = a->inode->meta.size;
-	for(cur = a->cache.file.datablocks; cur != nil; cur = cur->next){
-		nearest = cur->start;
-		assert(cur->end > cur->start);
-		if(r->ifcall.offset >= cur->start && r->ifcall.offset < cur->end){
-			// Found the block.
-			block = cur->datablock;
-			break;
-		} else if (cur->start > r->ifcall.offset) {
-			// Passed the block and never found it.
-			// FIXME: This assumes the list is sorted, but we haven't
-			// done anything to guarantee that. (It seems to be the
-			// case on disk from DragonFly, regardless.			
-			nearest = cur->start;
-			break;
-		}
+	wlock(a);
+	hammer2_key_t holeend;
+	int idx;
+	char *err = mapoffset(&a->cache.file.datablocks, offset, &idx, &holeend);
+	if(err != nil){
+		wunlock(a);
+		*errp = err;
+		return -1;
 	}
-	if(block == nil){
+	if(idx < 0){
 		// No block was found, so fill the zero hole.
-		assert(nearest > r->ifcall.offset);
-		int count = nearest-r->ifcall.offset;
-		if(count > r->ifcall.count) {
-			count = r->ifcall.count;
+		wunlock(a);
+		assert(holeend > offset);
+		if(count > holeend-offset) {
+			count = holeend-offset;
 		}
 		assert(count > 0);
-		r->ofcall.count = count;
-		memset(r->ofcall.data, 0, count);
-		respond(r, nil);
-		return;
+		memset(dst, 0, count);
+		return count;
 	}
+	// Readahead can add to the map, so make a copy of the extent.
+	Extent e = a->cache.file.datablocks.ext[idx];
+	hammer2_blockref_t eblock;
+	hammer2_blockref_t *block = &eblock;
+	unpackloc(&e.datablock, block);
 
-	wlock(a);
-	a->cache.file.lastbuf = realloc(a->cache.file.lastbuf, HAMMER2_BLOCKREF_LEAF_MAX+1);
+	readaheadfile(a, &e, sequential);
+	if (a->cache.file.lastbuf == nil)
+		a->cache.file.lastbuf = getscratch();
 
-	char *err = loadblock(block, a->cache.file.lastbuf, HAMMER2_BLOCKREF_LEAF_MAX+1, &a->cache.file.lastbufcount);
+	err = loadblock(block, a->cache.file.lastbuf, HAMMER2_BLOCKREF_LEAF_MAX+1, &a->cache.file.lastbufcount);
 	if (err != nil) {
 		a->cache.file.lastbufcount = 0;
-
-		respond(r, err);
 		wunlock(a);
-		return;
+		*errp = err;
+		return -1;
 	}
 	a->cache.file.lastbufoffset = block->key;
 	assert(a->cache.file.lastbuf != nil);
 	
-	int roffset = r->ifcall.offset-block->key;
-	int count = r->ifcall.count;
-	if(r->ifcall.offset + count > cur->end){
-		count = cur->end-r->ifcall.offset;
+	int roffset = offset-block->key;
+	if(offset + count > e.end){
+		count = e.end-offset;
 	}
 	assert(count > 0);
-	memcpy(r->ofcall.data, &a->cache.file.lastbuf[roffset], count);
-	r->ofcall.count = count;
-	respond(r, nil);
+	long avail = a->cache.file.lastbufcount - roffset;
+	if(avail < count){
+		// The block decompressed to less than its logical size, and
+		// the rest of it is zeros.
+		if(avail < 0)
+			avail = 0;
+		memset(dst+avail, 0, count-avail);
+	} else {
+		avail = count;
+	}
+	memcpy(dst, &a->cache.file.lastbuf[roffset], avail);
 	wunlock(a);
-	return;
+	return count;
+}
+
+void fileread(Req *r) {
+	Aux *a = r->fid->aux;
+	// Reading at/past EOF.
+	if (r->ifcall.offset == a->inode->meta.size) {
+		r->ofcall.count = 0;
+		respond(r, nil);
+		return;
+	} else if(r->ifcall.offset > a->inode->meta.size) {
+		r->ofcall.count = -1;
+		respond(r, "read past end of file");
+		return;
+	}
+
+	long count = r->ifcall.count;
+	if (r->ifcall.offset + count > a->inode->meta.size) {
+		// Ensure we don't send past EOF.
+		count = a->inode->meta.size - r->ifcall.offset;
+	}
+
+	// If data is stored in the inode, don't bother getting anything from
+	// disk.
+	if (a->inode->meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA) {
+		assert(a->inode->meta.size > r->ifcall.offset);
+		assert(r->ifcall.offset < HAMMER2_EMBEDDED_BYTES);
+		memcpy(r->ofcall.data, (void *)&a->inode->u.data[r->ifcall.offset], count);
+		r->ofcall.count = count;
+		respond(r, nil);
+		return;
+	}
+
+	// Fill as much of the read as we can, crossing as many blocks and
+	// holes as it takes, so that large reads don't need a round trip
+	// for every block.
+	int sequential = r->ifcall.offset == a->cache.file.nextoff && r->ifcall.offset != 0;
+	long done = 0;
+	long n;
+	char *err = nil;
+	while(done < count) {
+		n = fileblockread(a, (uchar*)r->ofcall.data+done, count-done, r->ifcall.offset+done, sequential, &err);
+		if (n < 0) {
+			break;
+		}
+		done += n;
+		sequential = 1;
+	}
+	if (done == 0 && err != nil) {
+		respond(r, err);
+		return;
+	}
+	// This is only a hint for readahead, so it doesn't matter if another
+	// reader races with us.
+	a->cache.file.nextoff = r->ifcall.offset + done;
+	r->ofcall.count = done;
+	respond(r, nil);
 }
 
 int verifycheck(hammer2_blockref_t *block, void *data) {
@@ -760,53 +1057,273 @@ int verifycheck(hammer2_blockref_t *block, void *data) {
 	return r;
 }
 
-/* Loads the block pointed to at data_off into dst (after decompression), and
- stores the size in rsize.
- Returns an error string if smething went wrong.
- Also validates check code */
-char* loadblock(hammer2_blockref_t *block, void *dst, int dstsize, int *rsize) {
-	uchar blockdata[HAMMER2_BLOCKREF_LEAF_MAX+1];
+/* Verifies the block pointed to at data_off, which must have been read
+ into b, and copies it into dst (after decompression), and stores the size in
+ rsize.
+ Returns an error string if smething went wrong. */
+char* decodeblock(Buf *b, hammer2_blockref_t *block, void *dst, int dstsize, int *rsize) {
+	uchar *blockdata;
 	int dsize = 1<<(block->data_off & HAMMER2_OFF_MASK_RADIX);
 	int off = block->data_off & HAMMER2_OFF_MASK_LO;
 	int csize;
 	int decsize;
+	char *err = nil;
 
-	pread(devfd, blockdata, HAMMER2_BLOCKREF_LEAF_MAX+1, block->data_off & HAMMER2_OFF_MASK_HI);
-	if (!verifycheck(block, &blockdata[off])) {
+	blockdata = b->data;
+	if (!verifyblock(b, block)) {
 		return "invalid checksum";
 	}
 	switch (HAMMER2_DEC_COMP(block->methods)){
 	case HAMMER2_COMP_AUTOZERO:
 	case HAMMER2_COMP_NONE:
+		if (dsize > dstsize)
+			dsize = dstsize;
 		if (rsize != nil)
 			*rsize = dsize;
 		memcpy(dst, &blockdata[off] , dsize); 
 		break;
 	case HAMMER2_COMP_LZ4:
 		csize = *(int*) &blockdata[off];
+		if (csize < 0 || csize > dsize-4) {
+			err = "bad read";
+			break;
+		}
 		decsize = LZ4_decompress_safe((char *)blockdata+off+4, (char *)dst, csize, dstsize);
-		if (decsize < 0)
-			return "bad read";
+		if (decsize < 0) {
+			err = "bad read";
+			break;
+		}
+		adddbuf(block, dst, decsize);
 		if (rsize != nil)
 			*rsize = decsize;
 		break;
 	case HAMMER2_COMP_ZLIB:
-		inflateinit();
 		decsize = inflatezlibblock(
 			dst, dstsize,
-			&blockdata[off], HAMMER2_BLOCKREF_LEAF_MAX-off
+			&blockdata[off], dsize
 		);
 		if (decsize < 0){
-			return flateerr(*rsize);
+			err = flateerr(decsize);
+			break;
 		}
+		adddbuf(block, dst, decsize);
 		if (rsize != nil)
 			*rsize = decsize;
 		break;
 	default:
 		printf("Comp: %d\n", HAMMER2_DEC_COMP(block->methods));
-		return "Unhandled compression";
+		err = "Unhandled compression";
 	}
-	return nil;
+	return err;
+}
+
+// A load of a block that's in progress, which anyone else who wants the same
+// block waits for and copies the result of instead of reading, verifying and
+// decompressing it again themselves. Once the block is in dst, the loader
+// waits for everyone who joined to copy it out before dst can go away.
+// Compressed blocks that are read ahead are in flight too, so that someone
+// who needs one before the readahead gets to it waits for it to be added to
+// the decompressed cache and takes it from there.
+struct Flight {
+	hammer2_off_t data_off;
+	uchar methods;
+	// The first 8 bytes of the block's check code, so that a load of
+	// an old version of the block isn't shared with a new one.
+	u64int check;
+	int ahead;
+
+	QLock lk;
+	Rendez ready;
+	Rendez drained;
+	int finished;
+	int waiters;
+
+	void *dst;
+	int dstsize;
+	int size;
+	char *err;
+
+	Flight *hnext;
+};
+
+enum {
+	NFLIGHTHASH = 64,
+};
+
+static struct {
+	Lock;
+	Flight *hash[NFLIGHTHASH];
+
+	uvlong loads;
+	uvlong shared;
+	uvlong ahead;
+} flights;
+
+static int flighthash(hammer2_off_t data_off) {
+	return (data_off >> 10) % NFLIGHTHASH;
+}
+
+static int sameflight(Flight *f, hammer2_blockref_t *block) {
+	return f->data_off == block->data_off && f->methods == block->methods && memcmp(&f->check, block->check.buf, sizeof(f->check)) == 0;
+}
+
+// Copies the decompressed contents of block into dst if it's compressed and
+// they're in the decompressed cache. Returns 1 if they were.
+static int loaddbuf(hammer2_blockref_t *block, void *dst, int dstsize, int *rsize) {
+	DBuf *d;
+	int n;
+
+	switch(HAMMER2_DEC_COMP(block->methods)) {
+	case HAMMER2_COMP_NONE:
+	case HAMMER2_COMP_AUTOZERO:
+		return 0;
+	}
+	d = lookdbuf(block);
+	if (d == nil) {
+		return 0;
+	}
+	// It was verified before it was added.
+	skippedcheck(block);
+	n = d->size < dstsize ? d->size : dstsize;
+	memcpy(dst, d->data, n);
+	if (rsize != nil)
+		*rsize = n;
+	putdbuf(d);
+	return 1;
+}
+
+// Puts a new flight for block into the table. Must be called with flights
+// locked.
+static Flight* newflight(hammer2_blockref_t *block, void *dst, int dstsize) {
+	Flight *f;
+	int h;
+
+	f = emalloc9p(sizeof(Flight));
+	f->data_off = block->data_off;
+	f->methods = block->methods;
+	memcpy(&f->check, block->check.buf, sizeof(f->check));
+	f->ready.l = &f->lk;
+	f->drained.l = &f->lk;
+	f->dst = dst;
+	f->dstsize = dstsize;
+	h = flighthash(block->data_off);
+	f->hnext = flights.hash[h];
+	flights.hash[h] = f;
+	return f;
+}
+
+// Starts a flight for reading block ahead. Returns nil if it's already being
+// loaded.
+Flight* startflight(hammer2_blockref_t *block) {
+	Flight *f;
+
+	lock(&flights);
+	for(f = flights.hash[flighthash(block->data_off)]; f != nil; f = f->hnext) {
+		if (sameflight(f, block)) {
+			unlock(&flights);
+			return nil;
+		}
+	}
+	// It has no buffer of its own, so it's big enough for anyone.
+	f = newflight(block, nil, HAMMER2_PBUFSIZE);
+	f->ahead = 1;
+	unlock(&flights);
+	return f;
+}
+
+// Finishes the flight f with the result of its load, and frees it once
+// everyone who was waiting for it has taken the result.
+void endflight(Flight *f, char *err, int size) {
+	Flight **l;
+
+	// Nobody else can join once it's out of the table.
+	lock(&flights);
+	for(l = &flights.hash[flighthash(f->data_off)]; *l != nil; l = &(*l)->hnext) {
+		if (*l == f) {
+			*l = f->hnext;
+			break;
+		}
+	}
+	unlock(&flights);
+
+	qlock(&f->lk);
+	f->err = err;
+	f->size = size;
+	f->finished = 1;
+	rwakeupall(&f->ready);
+	while(f->waiters > 0)
+		rsleep(&f->drained);
+	qunlock(&f->lk);
+	free(f);
+}
+
+// Loads block into dst through the I/O pipeline, unless it's compressed and
+// already in the decompressed cache. If someone else is already loading the
+// same block into a buffer at least as big, waits for them and copies their
+// result instead.
+char* loadblock(hammer2_blockref_t *block, void *dst, int dstsize, int *rsize) {
+	Flight *f;
+	char *err;
+	int n, size, ahead;
+
+again:
+	if (loaddbuf(block, dst, dstsize, rsize)) {
+		return nil;
+	}
+	lock(&flights);
+	for(f = flights.hash[flighthash(block->data_off)]; f != nil; f = f->hnext) {
+		if (sameflight(f, block) && f->dstsize >= dstsize) {
+			f->waiters++;
+			flights.shared++;
+			if (f->ahead)
+				flights.ahead++;
+			unlock(&flights);
+
+			qlock(&f->lk);
+			while(!f->finished)
+				rsleep(&f->ready);
+			// The loader's error strings are all static, so they
+			// outlive f.
+			err = f->err;
+			ahead = f->ahead;
+			if (err == nil && !ahead) {
+				n = f->size < dstsize ? f->size : dstsize;
+				memcpy(dst, f->dst, n);
+				if (rsize != nil)
+					*rsize = n;
+			}
+			if (--f->waiters == 0)
+				rwakeup(&f->drained);
+			qunlock(&f->lk);
+			// Readahead leaves the block in the decompressed
+			// cache, and if it was dropped or failed we load it
+			// ourselves.
+			if (ahead)
+				goto again;
+			return err;
+		}
+	}
+	flights.loads++;
+	f = newflight(block, dst, dstsize);
+	unlock(&flights);
+
+	size = 0;
+	err = ioload(block, dst, dstsize, &size);
+	if (rsize != nil && err == nil)
+		*rsize = size;
+	endflight(f, err, size);
+	return err;
+}
+
+void loadstats(void) {
+	uvlong loads, shared, ahead;
+
+	lock(&flights);
+	loads = flights.loads;
+	shared = flights.shared;
+	ahead = flights.ahead;
+	unlock(&flights);
+	print("block loads\t%ulld (%ulld more shared an in-flight load, %ulld of them readahead)\n", loads, shared, ahead);
 }
 
 hammer2_crc32_t icrc32(void *data, int size) {
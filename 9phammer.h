@@ -5,6 +5,186 @@ void readvolume(int fd, hammer2_dev_t *hd);
 char* loadblock(hammer2_blockref_t *block, void *dst, int dstsize, int *rsize);
 hammer2_crc32_t icrc32(void *buf, int n);
 
+// A cached 64KB physical buffer from the device.
+typedef struct Buf Buf;
+struct Buf {
+	QLock;
+	// The 64KB aligned offset of the buffer on disk, or HAMMER2_OFF_BAD
+	// if the buffer isn't in use.
+	hammer2_off_t off;
+	uchar *data;
+	// Bitmask of the HAMMER2_LBUFSIZE segments of data which have been
+	// read from disk.
+	int valid;
+	// Bitmask of the 1KB offsets in data which a block that has passed
+	// verifyblock starts at, and the size radix and first word of the
+	// check code of the block that passed at each of them.
+	uvlong testedgood;
+	uchar testedradix[64];
+	u32int testedcheck[64];
+
+	int ref;
+	// Set every time the buffer is used, cleared by the CLOCK hand.
+	int used;
+	// The buffer isn't part of the cache and is freed by putbuf.
+	int nocache;
+	Buf *hnext;
+};
+
+void initbcache(uvlong size);
+Buf* getbuf(hammer2_off_t off, int size);
+void putbuf(Buf *b);
+void dupbuf(Buf *b);
+int verifycheck(hammer2_blockref_t *block, void *data);
+int verifyblock(Buf *b, hammer2_blockref_t *block);
+void skippedcheck(hammer2_blockref_t *block);
+char* decodeblock(Buf *b, hammer2_blockref_t *block, void *dst, int dstsize, int *rsize);
+
+// A load of a block that others who want it can wait for.
+typedef struct Flight Flight;
+Flight* startflight(hammer2_blockref_t *block);
+void endflight(Flight *f, char *err, int size);
+
+void initio(int nread, int ndecode);
+char* ioload(hammer2_blockref_t *block, void *dst, int dstsize, int *rsize);
+Buf* ioreadbuf(hammer2_off_t off, int size);
+void ioreadbufs(hammer2_off_t *off, int *size, int n, void (*fn)(int, Buf*, void*), void *arg);
+void prefetch(hammer2_blockref_t *block);
+
+// A cached decompressed logical block.
+typedef struct DCache DCache;
+typedef struct DBuf DBuf;
+struct DBuf {
+	DCache *cache;
+	hammer2_off_t data_off;
+	uchar methods;
+	// The first 8 bytes of the block's check code.
+	u64int check;
+	uchar *data;
+	int size;
+
+	int ref;
+	DBuf *hnext;
+	// LRU list
+	DBuf *prev;
+	DBuf *next;
+};
+
+void initdcache(uvlong size);
+DBuf* lookdbuf(hammer2_blockref_t *block);
+void adddbuf(hammer2_blockref_t *block, void *data, int size);
+DBuf* looknbuf(hammer2_blockref_t *block);
+void addnbuf(hammer2_blockref_t *block, void *data, int size);
+void putdbuf(DBuf *d);
+void initncache(uvlong size);
+
+// A packed locator: the parts of a blockref needed to find, load and verify
+// the block it points to, for the indexes which keep many of them in memory.
+// It's a third of the size of a whole blockref. The check code is the first
+// 24 bytes of check.buf, which holds all of an iscsi32, xxhash64 or sha192
+// check.
+typedef struct Loc Loc;
+struct Loc {
+	hammer2_off_t data_off;
+	hammer2_key_t key;
+	uchar check[24];
+	uchar methods;
+	uchar keybits;
+	uchar type;
+};
+
+void packloc(hammer2_blockref_t *block, Loc *l);
+void unpackloc(Loc *l, hammer2_blockref_t *block);
+void initinodes(uvlong hint);
+void clearinodes(void);
+int lookinode(hammer2_tid_t inum, Loc *l);
+void addinode(hammer2_tid_t inum, hammer2_blockref_t *block);
+char* findinode(hammer2_tid_t inum, hammer2_blockref_t *block);
+hammer2_tid_t volumetid(int fd);
+void checkvolume(void);
+void beginreq(void);
+void endreq(void);
+void flushcaches(void);
+
+// The decoded attributes of an inode that stat and directory reads need.
+typedef struct Attr Attr;
+struct Attr {
+	hammer2_tid_t inum;
+	uchar type;
+	ulong mode;
+	uvlong size;
+	// In nanoseconds.
+	uvlong mtime;
+	uvlong atime;
+	uuid_t uid;
+	uuid_t gid;
+	hammer2_tid_t iparent;
+};
+
+void initattrs(int n);
+char* getattr(hammer2_tid_t inum, Attr *a);
+void prefetchattrs(hammer2_tid_t *inums, int n);
+void flushattrs(void);
+
+// A free list of objects of one size.
+typedef struct Slab Slab;
+struct Slab {
+	Lock;
+	char *name;
+	ulong size;
+	// The most free objects to keep.
+	int max;
+	void *free;
+	int nfree;
+
+	uvlong allocs;
+	uvlong reused;
+	Slab *link;
+};
+
+// Scratch memory for one traversal, freed all at once.
+typedef struct Arena Arena;
+struct Arena {
+	void *chunks;
+	uchar *cur;
+	ulong used;
+
+	int nchunks;
+	int nbig;
+	uvlong bytes;
+};
+
+void initslab(Slab *s, char *name, ulong size, int max);
+void* slaballoc(Slab *s);
+void slabfree(Slab *s, void *v);
+void initscratch(int max);
+void* getscratch(void);
+void putscratch(void *v);
+void initarena(Arena *a);
+void* arenaalloc(Arena *a, ulong n);
+void freearena(Arena *a);
+
+// A node in the blockref tree, loaded by getnode.
+typedef struct Node Node;
+struct Node {
+	hammer2_blockref_t *brefs;
+	int count;
+
+	// Whichever of these holds brefs.
+	Buf *buf;
+	DBuf *dbuf;
+	uchar *data;
+};
+
+hammer2_key_t keyend(hammer2_blockref_t *block, hammer2_key_t limit);
+char* getnode(hammer2_blockref_t *block, Node *n);
+void putnode(Node *n);
+char* lookupkey(hammer2_blockref_t *base, int count, hammer2_key_t key, int type, hammer2_blockref_t *out);
+hammer2_key_t dirhash(char *name, int len);
+char* direntname(hammer2_blockref_t *block, char *buf);
+char* scankeys(hammer2_blockref_t *base, int count, hammer2_key_t beg, hammer2_key_t last, void (*fn)(hammer2_blockref_t*, void*), void *arg);
+char* scanfrom(hammer2_blockref_t *base, int count, hammer2_key_t beg, int (*fn)(hammer2_blockref_t*, void*), void *arg);
+
 void initcons(char *service);
 void fsstart(Srv *);
 void fsattach(Req *r);
@@ -12,6 +192,7 @@ void fsopen(Req *r);
 char* fswalk(Fid *fid, char *name, Qid *qid);
 char* fswalkclone(Fid *old, Fid *new);
 void fsstat(Req *r);
+void fsdestroyfid(Fid *fid);
 void fsread(Req *r);
 
 // constantly writing out the whole name is annoying, so we make a type
@@ -26,10 +207,107 @@ typedef struct{
 	vlong cap;
 } DirEnts;
 
+// A range of keys [start, end).
+typedef struct{
+	hammer2_key_t start;
+	hammer2_key_t end;
+} KeyRange;
+
+// A data block of a file, covering the file offsets [start, end).
+typedef struct Extent Extent;
+struct Extent {
+	hammer2_key_t start;
+	hammer2_key_t end;
+
+	Loc datablock;
+};
+
+// The data blocks of a file that have been looked up so far, sorted by start
+// so that the block for an offset can be found with a binary search. resolved
+// holds the sorted ranges of the file that all the data blocks are known
+// for. Offsets in a resolved range which aren't in any extent are holes.
+typedef struct {
+	inode *in;
+
+	Extent *ext;
+	int count;
+	int cap;
+
+	KeyRange *resolved;
+	int nresolved;
+	int rcap;
+} BlockMap;
+
+void initblockmap(BlockMap *m, inode *in);
+void freeblockmap(BlockMap *m);
+char* mapoffset(BlockMap *m, vlong offset, int *idx, hammer2_key_t *holeend);
+
+// The entries of a directory packed into 9P stat format, in key order.
+// offs[i] is where entry i starts in data, and offs[count] is size. keys[i]
+// is the key of entry i's directory entry.
+typedef struct StatDir StatDir;
+struct StatDir {
+	hammer2_tid_t inum;
+	uchar *data;
+	long size;
+	long *offs;
+	hammer2_key_t *keys;
+	int count;
+
+	int ref;
+	// It's no longer in the cache, and is freed when it's released.
+	int removed;
+	// The directory is too big to cache, and this only remembers that
+	// so that it isn't tried again.
+	int big;
+	StatDir *hnext;
+	// LRU list
+	StatDir *prev;
+	StatDir *next;
+};
+
+void initstatcache(uvlong size);
+StatDir* getstatdir(hammer2_tid_t inum, inode *dir);
+void putstatdir(StatDir *d);
+void dupstatdir(StatDir *d);
+void flushstatcache(void);
+int direntstat(hammer2_blockref_t *block, Dir *dir);
+
+void initsidecar(char *file, inode *pfs, uuid_t *fsid, hammer2_tid_t tid);
+int sidecarinode(hammer2_tid_t inum, hammer2_blockref_t *block);
+int sidecarlookup(hammer2_tid_t parent, char *name, hammer2_tid_t *inum, uchar *type);
+void dropsidecar(void);
+
+void initnamecache(int n);
+int looknamecache(hammer2_tid_t parent, char *name, Qid *q);
+void addnamecache(hammer2_tid_t parent, char *name, Qid q);
+void flushnamecache(void);
+
 typedef struct{
 	Qid;
 	inode;
-	DirEnts;
 	char *pfsname;
 } root_t;
 
+// Classes of work. The worker pool and the I/O queue are shared between them
+// in proportion to their weights, so a client streaming a big file can't
+// starve everyone else's walks and directory listings.
+enum {
+	// Walks, opens, stats and directory reads.
+	PMeta,
+	// File reads.
+	PData,
+	// Blocks read ahead of sequential file reads.
+	PAhead,
+	// Background work, like building the sidecar.
+	PScrub,
+	NPRIO,
+	// What a weight of 1 costs in the fair queues' virtual time.
+	PRIOSCALE = 1024,
+};
+
+void setprio(int prio);
+int getprio(void);
+int prioweight(int prio);
+char* setprioweight(char *name, int weight);
+char* prioname(int prio);
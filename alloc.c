@@ -0,0 +1,187 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <thread.h>
+#include <9p.h>
+
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+// Objects which are allocated and freed all the time (inodes and Aux for
+// every walk, 64KB buffers for every compressed indirect block) come from
+// slabs, which keep a free list of objects of one size for reuse instead of
+// going back to malloc every time.
+//
+// Scratch space which is only needed for the length of one traversal comes
+// from an Arena, which hands out pieces of 64KB scratch buffers and gives them
+// all back at once when it's freed.
+
+static Slab *slabs;
+static Lock slabslock;
+
+static Slab scratchslab;
+
+static struct {
+	Lock;
+	uvlong arenas;
+	uvlong chunks;
+	uvlong bytes;
+	uvlong big;
+} astats;
+
+void initslab(Slab *s, char *name, ulong size, int max) {
+	// Free objects are linked through their first word.
+	if (size < sizeof(void*))
+		size = sizeof(void*);
+	s->name = name;
+	s->size = size;
+	s->max = max;
+	lock(&slabslock);
+	s->link = slabs;
+	slabs = s;
+	unlock(&slabslock);
+}
+
+// Returns an object from s. Unlike emalloc9p, it isn't zeroed.
+void* slaballoc(Slab *s) {
+	void *v;
+
+	lock(s);
+	s->allocs++;
+	if (s->free != nil) {
+		v = s->free;
+		s->free = *(void**)v;
+		s->nfree--;
+		s->reused++;
+		unlock(s);
+		return v;
+	}
+	unlock(s);
+	return emalloc9p(s->size);
+}
+
+void slabfree(Slab *s, void *v) {
+	if (v == nil) {
+		return;
+	}
+	lock(s);
+	if (s->nfree < s->max) {
+		*(void**)v = s->free;
+		s->free = v;
+		s->nfree++;
+		unlock(s);
+		return;
+	}
+	unlock(s);
+	free(v);
+}
+
+// Scratch buffers are big enough to hold any block, so they're used for
+// decompressing blocks as well as for arena chunks.
+void initscratch(int max) {
+	initslab(&scratchslab, "scratch", HAMMER2_PBUFSIZE, max);
+}
+
+void* getscratch(void) {
+	return slaballoc(&scratchslab);
+}
+
+void putscratch(void *v) {
+	slabfree(&scratchslab, v);
+}
+
+// The header of every piece of memory an arena gets, linking them together so
+// they can be given back.
+typedef struct Chunk Chunk;
+struct Chunk {
+	Chunk *next;
+	int big;
+	// Keep what follows aligned for anything.
+	uvlong pad;
+};
+
+void initarena(Arena *a) {
+	memset(a, 0, sizeof(Arena));
+}
+
+// Returns n bytes which last until a is freed.
+void* arenaalloc(Arena *a, ulong n) {
+	Chunk *c;
+	void *v;
+
+	// Keep every allocation 8-byte aligned.
+	n = (n + 7) & ~7;
+	if (n > HAMMER2_PBUFSIZE - sizeof(Chunk)) {
+		// Too big for a chunk, so it gets its own.
+		c = emalloc9p(sizeof(Chunk) + n);
+		c->big = 1;
+		c->next = a->chunks;
+		a->chunks = c;
+		a->nbig++;
+		a->bytes += n;
+		return c + 1;
+	}
+	if (a->cur == nil || a->used + n > HAMMER2_PBUFSIZE) {
+		c = getscratch();
+		c->big = 0;
+		c->next = a->chunks;
+		a->chunks = c;
+		a->cur = (uchar*)c;
+		a->used = sizeof(Chunk);
+		a->nchunks++;
+	}
+	v = a->cur + a->used;
+	a->used += n;
+	a->bytes += n;
+	return v;
+}
+
+// Gives back everything that was allocated from a.
+void freearena(Arena *a) {
+	Chunk *c, *next;
+
+	lock(&astats);
+	astats.arenas++;
+	astats.chunks += a->nchunks;
+	astats.big += a->nbig;
+	astats.bytes += a->bytes;
+	unlock(&astats);
+	for(c = a->chunks; c != nil; c = next) {
+		next = c->next;
+		if (c->big)
+			free(c);
+		else
+			putscratch(c);
+	}
+	memset(a, 0, sizeof(Arena));
+}
+
+void allocstats(void) {
+	Slab *s, *list;
+	uvlong allocs, reused, arenas, chunks, big, bytes;
+	int nfree;
+
+	// Slabs are never removed from the list, so it can be walked
+	// without holding the lock.
+	lock(&slabslock);
+	list = slabs;
+	unlock(&slabslock);
+	for(s = list; s != nil; s = s->link) {
+		lock(s);
+		allocs = s->allocs;
+		reused = s->reused;
+		nfree = s->nfree;
+		unlock(s);
+		print("%s slab\t%ulld allocs, %ulld reused, %d free of %lud bytes\n", s->name, allocs, reused, nfree, s->size);
+	}
+
+	lock(&astats);
+	arenas = astats.arenas;
+	chunks = astats.chunks;
+	big = astats.big;
+	bytes = astats.bytes;
+	unlock(&astats);
+	print("arenas\t%ulld (%ulld chunks, %ulld oversized, %ulld bytes)\n", arenas, chunks, big, bytes);
+}
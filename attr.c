@@ -0,0 +1,325 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <thread.h>
+#include <9p.h>
+
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+// The attribute cache holds the parts of inodes that stat and directory reads
+// need, keyed by inum, so that listing a directory or stating a file that was
+// recently looked at doesn't need to find, load and verify the whole 1KB
+// inode again. It's shared by every fid and has a fixed number of entries,
+// which are reclaimed with the CLOCK algorithm like the buffer cache.
+//
+// Everything in it is thrown away if the volume's mirror_tid changes, since
+// the inodes may have been rewritten.
+typedef struct ACEnt ACEnt;
+struct ACEnt {
+	Attr;
+	int valid;
+	int used;
+	ACEnt *hnext;
+};
+
+static struct {
+	Lock;
+
+	ACEnt *ents;
+	int nent;
+	int hand;
+
+	ACEnt **hash;
+	int nhash;
+
+	int count;
+	uvlong hits;
+	uvlong misses;
+	uvlong evictions;
+	uvlong flushes;
+	// Inodes loaded by prefetchattrs, and the number of buffer reads it
+	// took to load them.
+	uvlong batched;
+	uvlong batchreads;
+} acache;
+
+void initattrs(int n) {
+	if (n < 16) {
+		n = 16;
+	}
+	acache.nent = n;
+	acache.ents = emalloc9p(n*sizeof(ACEnt));
+	acache.nhash = n;
+	acache.hash = emalloc9p(n*sizeof(ACEnt*));
+}
+
+static int attrhash(hammer2_tid_t inum) {
+	return (inum * 0x9E3779B97F4A7C15ULL) % acache.nhash;
+}
+
+static void unhashattr(ACEnt *e) {
+	ACEnt **l;
+
+	for(l = &acache.hash[attrhash(e->inum)]; *l != nil; l = &(*l)->hnext) {
+		if (*l == e) {
+			*l = e->hnext;
+			break;
+		}
+	}
+	e->hnext = nil;
+	e->valid = 0;
+	acache.count--;
+}
+
+// Must be called with acache locked.
+static ACEnt* attrvictim(void) {
+	ACEnt *e;
+
+	for(;;) {
+		e = &acache.ents[acache.hand];
+		acache.hand = (acache.hand + 1) % acache.nent;
+		if (!e->valid) {
+			return e;
+		}
+		if (e->used) {
+			e->used = 0;
+			continue;
+		}
+		acache.evictions++;
+		unhashattr(e);
+		return e;
+	}
+}
+
+static void fillattr(inode *in, Attr *a) {
+	a->inum = in->meta.inum;
+	a->type = in->meta.type;
+	a->mode = in->meta.mode;
+	a->size = in->meta.size;
+	a->mtime = in->meta.mtime;
+	a->atime = in->meta.atime;
+	a->uid = in->meta.uid;
+	a->gid = in->meta.gid;
+	a->iparent = in->meta.iparent;
+}
+
+// Returns 1 and fills in a if the attributes of inum are cached.
+static int lookattr(hammer2_tid_t inum, Attr *a) {
+	ACEnt *e;
+
+	lock(&acache);
+	for(e = acache.hash[attrhash(inum)]; e != nil; e = e->hnext) {
+		if (e->inum == inum) {
+			e->used = 1;
+			*a = e->Attr;
+			acache.hits++;
+			unlock(&acache);
+			return 1;
+		}
+	}
+	acache.misses++;
+	unlock(&acache);
+	return 0;
+}
+
+static void addattr(Attr *a) {
+	ACEnt *e;
+
+	lock(&acache);
+	for(e = acache.hash[attrhash(a->inum)]; e != nil; e = e->hnext) {
+		if (e->inum == a->inum) {
+			// Someone else got here first.
+			unlock(&acache);
+			return;
+		}
+	}
+	e = attrvictim();
+	e->Attr = *a;
+	e->valid = 1;
+	e->used = 1;
+	e->hnext = acache.hash[attrhash(a->inum)];
+	acache.hash[attrhash(a->inum)] = e;
+	acache.count++;
+	unlock(&acache);
+}
+
+// Loads the inode inum from block and adds its attributes to the cache.
+static char* loadattr(hammer2_tid_t inum, hammer2_blockref_t *block, Attr *a) {
+	inode in;
+	char *err;
+
+	err = loadblock(block, &in, sizeof(inode), nil);
+	if (err != nil) {
+		return err;
+	}
+	fillattr(&in, a);
+	// The inode may be stored under a different inum than we were asked
+	// for if the tree is damaged, so always cache it by the one we looked
+	// up.
+	a->inum = inum;
+	addattr(a);
+	return nil;
+}
+
+// Fills in a with the attributes of the inode inum, loading the inode if they
+// aren't cached.
+char* getattr(hammer2_tid_t inum, Attr *a) {
+	hammer2_blockref_t block;
+	char *err;
+
+	if (lookattr(inum, a)) {
+		return nil;
+	}
+	err = findinode(inum, &block);
+	if (err != nil) {
+		return err;
+	}
+	return loadattr(inum, &block, a);
+}
+
+static int loccmp(void *va, void *vb) {
+	Loc *a = va;
+	Loc *b = vb;
+	hammer2_off_t aoff = a->data_off & HAMMER2_OFF_MASK;
+	hammer2_off_t boff = b->data_off & HAMMER2_OFF_MASK;
+
+	if (aoff < boff)
+		return -1;
+	if (aoff > boff)
+		return 1;
+	return 0;
+}
+
+// The inodes of a listing, sorted by where they are on disk, and the groups
+// of them that share a physical buffer.
+typedef struct {
+	Loc *locs;
+	// The index of the first inode of each group, and one past the last.
+	int *first;
+	hammer2_off_t *off;
+	int *size;
+} Batch;
+
+// Loads the inodes of group g while the buffer they're in is held. If it
+// couldn't be read, loading them one at a time gets the error reported where
+// it belongs.
+static void loadgroup(int g, Buf*, void *v) {
+	Batch *bt = v;
+	hammer2_blockref_t block;
+	Attr a;
+	int k;
+
+	for(k = bt->first[g]; k < bt->first[g+1]; k++) {
+		unpackloc(&bt->locs[k], &block);
+		loadattr(bt->locs[k].key, &block, &a);
+	}
+	lock(&acache);
+	acache.batched += bt->first[g+1] - bt->first[g];
+	acache.batchreads++;
+	unlock(&acache);
+}
+
+// Loads the attributes of the n inodes in inums that aren't already cached.
+// The inodes which share a physical buffer are read in with a single read,
+// and the reads of every buffer are queued at once, so that the readers sweep
+// across the disk once for the whole listing, instead of seeking back and
+// forth in hash order or waiting for each buffer before asking for the next.
+// Each buffer's inodes are decoded as soon as it's read.
+void prefetchattrs(hammer2_tid_t *inums, int n) {
+	Loc *l;
+	Arena ar;
+	Batch bt;
+	hammer2_blockref_t block;
+	Attr a;
+	hammer2_off_t start, end, off;
+	int i, j, nl, ng;
+
+	initarena(&ar);
+	l = arenaalloc(&ar, n*sizeof(Loc));
+	nl = 0;
+	for(i = 0; i < n; i++) {
+		if (lookattr(inums[i], &a)) {
+			continue;
+		}
+		if (findinode(inums[i], &block) != nil) {
+			// getattr will report the error when the entry is
+			// read.
+			continue;
+		}
+		// The inode's key is its inum.
+		packloc(&block, &l[nl]);
+		l[nl].key = inums[i];
+		nl++;
+	}
+	qsort(l, nl, sizeof(Loc), loccmp);
+
+	bt.locs = l;
+	bt.first = arenaalloc(&ar, (nl+1)*sizeof(int));
+	bt.off = arenaalloc(&ar, (nl+1)*sizeof(hammer2_off_t));
+	bt.size = arenaalloc(&ar, (nl+1)*sizeof(int));
+	ng = 0;
+	for(i = 0; i < nl; i = j) {
+		start = l[i].data_off & HAMMER2_OFF_MASK;
+		end = start + (1<<(l[i].data_off & HAMMER2_OFF_MASK_RADIX));
+		for(j = i+1; j < nl; j++) {
+			off = l[j].data_off & HAMMER2_OFF_MASK;
+			if ((off & HAMMER2_OFF_MASK_HI) != (start & HAMMER2_OFF_MASK_HI)) {
+				break;
+			}
+			off += 1<<(l[j].data_off & HAMMER2_OFF_MASK_RADIX);
+			if (off > end)
+				end = off;
+		}
+		bt.first[ng] = i;
+		bt.off[ng] = start;
+		bt.size[ng] = end - start;
+		ng++;
+	}
+	bt.first[ng] = nl;
+	ioreadbufs(bt.off, bt.size, ng, loadgroup, &bt);
+	freearena(&ar);
+}
+
+// Throws away every cached attribute.
+void flushattrs(void) {
+	int i;
+
+	lock(&acache);
+	for(i = 0; i < acache.nent; i++) {
+		acache.ents[i].valid = 0;
+		acache.ents[i].used = 0;
+		acache.ents[i].hnext = nil;
+	}
+	memset(acache.hash, 0, acache.nhash*sizeof(ACEnt*));
+	acache.count = 0;
+	acache.flushes++;
+	unlock(&acache);
+}
+
+void attrstats(void) {
+	uvlong hits, misses, evictions, flushes, batched, batchreads;
+	int count, nent;
+
+	lock(&acache);
+	count = acache.count;
+	nent = acache.nent;
+	hits = acache.hits;
+	misses = acache.misses;
+	evictions = acache.evictions;
+	flushes = acache.flushes;
+	batched = acache.batched;
+	batchreads = acache.batchreads;
+	unlock(&acache);
+
+	print("attrs\t%d/%d\n", count, nent);
+	print("attr hits\t%ulld\n", hits);
+	print("attr misses\t%ulld\n", misses);
+	if (hits + misses > 0)
+		print("attr hit rate\t%ulld%%\n", hits*100/(hits+misses));
+	print("attr evictions\t%ulld\n", evictions);
+	print("attr flushes\t%ulld\n", flushes);
+	print("attr batch loads\t%ulld inodes in %ulld reads\n", batched, batchreads);
+}
@@ -0,0 +1,240 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <thread.h>
+#include <9p.h>
+
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+// A BlockMap is built lazily as a file is read. Each lookup of an offset that
+// isn't already mapped descends the file's blockref tree along the key range
+// that contains it, and every node it passes through is added to the map: its
+// data blocks become extents and the parts of its key range which aren't
+// covered by an indirect block are marked resolved. Lookups which land in a
+// resolved range are a binary search, and only need to touch the disk when
+// they move into a part of the file that hasn't been looked at yet.
+
+void initblockmap(BlockMap *m, inode *in) {
+	memset(m, 0, sizeof(BlockMap));
+	m->in = in;
+}
+
+void freeblockmap(BlockMap *m) {
+	free(m->ext);
+	free(m->resolved);
+	memset(m, 0, sizeof(BlockMap));
+}
+
+// Returns the index of the first extent in m which ends after offset.
+static int extentafter(BlockMap *m, vlong offset) {
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = m->count;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if (m->ext[mid].end <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void addextent(BlockMap *m, hammer2_blockref_t *block) {
+	int i;
+	Extent *e;
+
+	i = extentafter(m, block->key);
+	if (i < m->count && m->ext[i].start == block->key) {
+		// Already mapped.
+		return;
+	}
+	if (m->cap == m->count) {
+		m->cap = m->cap == 0 ? 16 : m->cap*2;
+		m->ext = erealloc9p(m->ext, m->cap*sizeof(Extent));
+	}
+	memmove(&m->ext[i+1], &m->ext[i], (m->count-i)*sizeof(Extent));
+	m->count++;
+	e = &m->ext[i];
+	e->start = block->key;
+	e->end = keyend(block, m->in->meta.size);
+	packloc(block, &e->datablock);
+}
+
+// Returns the index of the first resolved range in m which ends after offset.
+static int resolvedafter(BlockMap *m, vlong offset) {
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = m->nresolved;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if (m->resolved[mid].end <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Marks [start, end) as resolved, merging it with any resolved ranges it
+// touches.
+static void addresolved(BlockMap *m, hammer2_key_t start, hammer2_key_t end) {
+	int i, j;
+
+	if (start >= end) {
+		return;
+	}
+	// Find the ranges that overlap or are adjacent to [start, end).
+	i = resolvedafter(m, start);
+	if (i > 0 && m->resolved[i-1].end == start)
+		i--;
+	for(j = i; j < m->nresolved && m->resolved[j].start <= end; j++) {
+		if (m->resolved[j].start < start)
+			start = m->resolved[j].start;
+		if (m->resolved[j].end > end)
+			end = m->resolved[j].end;
+	}
+	if (j == i) {
+		// Nothing to merge with, so make room for a new one.
+		if (m->rcap == m->nresolved) {
+			m->rcap = m->rcap == 0 ? 8 : m->rcap*2;
+			m->resolved = erealloc9p(m->resolved, m->rcap*sizeof(KeyRange));
+		}
+		memmove(&m->resolved[i+1], &m->resolved[i], (m->nresolved-i)*sizeof(KeyRange));
+		m->nresolved++;
+	} else if (j > i+1) {
+		memmove(&m->resolved[i+1], &m->resolved[j], (m->nresolved-j)*sizeof(KeyRange));
+		m->nresolved -= j-i-1;
+	}
+	m->resolved[i].start = start;
+	m->resolved[i].end = end;
+}
+
+static int keyrangecmp(void *va, void *vb) {
+	KeyRange *a = va;
+	KeyRange *b = vb;
+	if (a->start < b->start)
+		return -1;
+	if (a->start > b->start)
+		return 1;
+	return 0;
+}
+
+// Adds the children of a node covering [start, end) to m. Everything in the
+// node's range except for what's under its indirect blocks becomes resolved.
+// Scratch space comes from the traversal's arena.
+static void resolvenode(BlockMap *m, Arena *ar, hammer2_blockref_t *base, int count, hammer2_key_t start, hammer2_key_t end) {
+	KeyRange *ind;
+	int i, nind;
+
+	ind = arenaalloc(ar, count*sizeof(KeyRange));
+	nind = 0;
+	for(i = 0; i < count; i++) {
+		switch(base[i].type) {
+		case HAMMER2_BREF_TYPE_DATA:
+			if (base[i].key < end)
+				addextent(m, &base[i]);
+			break;
+		case HAMMER2_BREF_TYPE_INDIRECT:
+			ind[nind].start = base[i].key;
+			ind[nind].end = keyend(&base[i], end);
+			nind++;
+			break;
+		}
+	}
+	qsort(ind, nind, sizeof(KeyRange), keyrangecmp);
+	for(i = 0; i < nind; i++) {
+		addresolved(m, start, ind[i].start);
+		if (ind[i].end > start)
+			start = ind[i].end;
+	}
+	addresolved(m, start, end);
+}
+
+// Descends the blockref tree of m's inode towards offset, adding every node on
+// the way to the map.
+static char* descend(BlockMap *m, vlong offset) {
+	hammer2_blockref_t *base;
+	hammer2_key_t start, end;
+	Node n, next;
+	Arena ar;
+	int i, count, havenode;
+	char *err;
+
+	initarena(&ar);
+	base = m->in->u.blockset.blockref;
+	count = HAMMER2_SET_COUNT;
+	start = 0;
+	end = m->in->meta.size;
+	havenode = 0;
+	for(;;) {
+		resolvenode(m, &ar, base, count, start, end);
+		for(i = 0; i < count; i++) {
+			if (base[i].type == HAMMER2_BREF_TYPE_INDIRECT
+				&& offset >= base[i].key
+				&& offset < keyend(&base[i], end))
+				break;
+		}
+		if (i == count) {
+			break;
+		}
+		err = getnode(&base[i], &next);
+		if (err != nil) {
+			if (havenode)
+				putnode(&n);
+			freearena(&ar);
+			return err;
+		}
+		start = base[i].key;
+		end = keyend(&base[i], end);
+		if (havenode)
+			putnode(&n);
+		n = next;
+		havenode = 1;
+		base = n.brefs;
+		count = n.count;
+	}
+	if (havenode)
+		putnode(&n);
+	freearena(&ar);
+	return nil;
+}
+
+// Finds the data block that offset is in, loading whatever indirect blocks
+// are needed to find it. Sets *idx to the index of its extent in m, or to -1
+// if offset is in a hole, in which case *holeend is set to where the hole ends.
+// Returns an error string if the indirect blocks couldn't be loaded.
+char* mapoffset(BlockMap *m, vlong offset, int *idx, hammer2_key_t *holeend) {
+	int i;
+	char *err;
+
+	i = resolvedafter(m, offset);
+	if (i == m->nresolved || m->resolved[i].start > offset) {
+		err = descend(m, offset);
+		if (err != nil) {
+			return err;
+		}
+		i = resolvedafter(m, offset);
+		if (i == m->nresolved || m->resolved[i].start > offset) {
+			return "offset not in block map";
+		}
+	}
+
+	*idx = extentafter(m, offset);
+	if (*idx < m->count && m->ext[*idx].start <= offset) {
+		return nil;
+	}
+	// A hole ends at the next data block, or where we stop knowing what's
+	// there.
+	if (*idx < m->count && m->ext[*idx].start < m->resolved[i].end)
+		*holeend = m->ext[*idx].start;
+	else
+		*holeend = m->resolved[i].end;
+	*idx = -1;
+	return nil;
+}
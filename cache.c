@@ -0,0 +1,646 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <thread.h>
+#include <9p.h>
+
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+extern int devfd;
+
+// The buffer cache holds raw 64KB physical buffers, keyed by the
+// buffer's offset on disk (data_off & HAMMER2_OFF_MASK_HI). Since many blocks
+// (inodes, indirect blocks, small files) share the same physical buffer, a
+// single read can satisfy many later loadblock() calls.
+//
+// Buffers are only read in HAMMER2_LBUFSIZE (16KB) segments as they're
+// needed, so loading a 1KB inode reads 16KB instead of the whole 64KB
+// physical buffer.
+//
+// Buffers are reclaimed with the CLOCK algorithm: every hit sets the used
+// bit, and the hand clears it on its way around until it finds a buffer that
+// hasn't been used since it last passed and isn't referenced by anyone.
+static struct {
+	Lock;
+
+	Buf *bufs;
+	int nbuf;
+	int hand;
+
+	Buf **hash;
+	int nhash;
+
+	uvlong hits;
+	uvlong partial;
+	uvlong misses;
+	uvlong evictions;
+	uvlong nocache;
+
+	uvlong reads;
+	uvlong bytesread;
+} bcache;
+
+// The decompressed cache is a second tier above the buffer cache which holds
+// the output of decompressing LZ4 and zlib blocks, so that hot compressed
+// files don't need to be decompressed again every time they're read. It's
+// keyed by the block's data_off, methods and check code, kept in LRU order,
+// and has its own memory budget separate from the buffer cache. Hits aren't
+// verified again, so the check code is part of the key: the readahead and
+// sidecar procs can add a block of an old version of the volume after it's
+// been flushed, and if its space is reused the new block won't match it.
+//
+// The node cache works the same way, but holds copies of the blockref tables
+// of indirect blocks which have been visited by lookups. It's small, but
+// unlike the buffer cache it isn't churned by file data, so lookups near the
+// top of the tree almost never need to go back to the buffer cache.
+struct DCache {
+	Lock;
+	char *name;
+
+	DBuf **hash;
+	int nhash;
+
+	// Most recently used first.
+	DBuf *head;
+	DBuf *tail;
+
+	uvlong size;
+	uvlong maxsize;
+	int count;
+
+	uvlong hits;
+	uvlong misses;
+	uvlong evictions;
+	uvlong bytesin;
+	uvlong bytesout;
+};
+
+static DCache dcache;
+static DCache ncache;
+
+// Counts of check codes that were computed, and that were skipped because the
+// block had already been verified since it was read, indexed by check method.
+static struct {
+	Lock;
+	uvlong checked[HAMMER2_CHECK_FREEMAP+1];
+	uvlong skipped[HAMMER2_CHECK_FREEMAP+1];
+	uvlong skippedbytes;
+} vstats;
+
+void initbcache(uvlong size) {
+	int i;
+
+	bcache.nbuf = size / HAMMER2_PBUFSIZE;
+	if (bcache.nbuf < 16) {
+		// Always keep enough buffers around for a few levels of
+		// indirection to be referenced at once.
+		bcache.nbuf = 16;
+	}
+	bcache.bufs = emalloc9p(bcache.nbuf*sizeof(Buf));
+	for(i = 0; i < bcache.nbuf; i++) {
+		// data is allocated the first time the buffer is used, so
+		// that a large limit doesn't cost anything until it's needed.
+		bcache.bufs[i].off = HAMMER2_OFF_BAD;
+	}
+	bcache.nhash = bcache.nbuf;
+	bcache.hash = emalloc9p(bcache.nhash*sizeof(Buf*));
+}
+
+static void initdc(DCache *c, char *name, uvlong size) {
+	c->name = name;
+	c->maxsize = size;
+	c->nhash = size / HAMMER2_LBUFSIZE;
+	if (c->nhash < 64) {
+		c->nhash = 64;
+	}
+	c->hash = emalloc9p(c->nhash*sizeof(DBuf*));
+}
+
+void initdcache(uvlong size) {
+	initdc(&dcache, "decompressed", size);
+}
+
+void initncache(uvlong size) {
+	initdc(&ncache, "node", size);
+}
+
+static int bufhash(hammer2_off_t off) {
+	return (off / HAMMER2_PBUFSIZE) % bcache.nhash;
+}
+
+static void unhashbuf(Buf *b) {
+	Buf **l;
+
+	for(l = &bcache.hash[bufhash(b->off)]; *l != nil; l = &(*l)->hnext) {
+		if (*l == b) {
+			*l = b->hnext;
+			break;
+		}
+	}
+	b->hnext = nil;
+	b->off = HAMMER2_OFF_BAD;
+}
+
+// Find a buffer to reuse with the CLOCK algorithm. Must be called with
+// bcache locked. Returns nil if every buffer is currently referenced.
+static Buf* victim(void) {
+	Buf *b;
+	int i;
+
+	for(i = 0; i < 2*bcache.nbuf; i++) {
+		b = &bcache.bufs[bcache.hand];
+		bcache.hand = (bcache.hand + 1) % bcache.nbuf;
+		if (b->ref > 0) {
+			continue;
+		}
+		if (b->used) {
+			b->used = 0;
+			continue;
+		}
+		if (b->off != HAMMER2_OFF_BAD) {
+			bcache.evictions++;
+			unhashbuf(b);
+		}
+		return b;
+	}
+	return nil;
+}
+
+// Returns the mask of HAMMER2_LBUFSIZE segments of a physical buffer that
+// the size bytes at off (relative to the start of the buffer) fall in.
+static int segmask(int off, int size) {
+	int first, last;
+
+	first = off / HAMMER2_LBUFSIZE;
+	last = (off + size - 1) / HAMMER2_LBUFSIZE;
+	assert(last < HAMMER2_PBUFSIZE/HAMMER2_LBUFSIZE);
+	return ((1<<(last+1)) - 1) & ~((1<<first) - 1);
+}
+
+// Reads the segments in mask which aren't already valid from disk with a
+// single read. Must be called with b locked.
+static int fillbuf(Buf *b, int mask) {
+	int need, first, last, off, size;
+	long n;
+
+	need = mask & ~b->valid;
+	if (need == 0) {
+		return 0;
+	}
+	for(first = 0; (need & (1<<first)) == 0; first++)
+		;
+	for(last = first; need >> (last+1) != 0; last++)
+		;
+	off = first*HAMMER2_LBUFSIZE;
+	size = (last-first+1)*HAMMER2_LBUFSIZE;
+
+	n = pread(devfd, b->data+off, size, b->off+off);
+	if (n < 0) {
+		return -1;
+	}
+	if (n < size) {
+		// Short read at the end of the device.
+		memset(b->data+off+n, 0, size-n);
+	}
+	lock(&bcache);
+	bcache.reads++;
+	bcache.bytesread += size;
+	unlock(&bcache);
+	b->valid |= ((1<<(last+1)) - 1) & ~((1<<first) - 1);
+	return 0;
+}
+
+// Returns a referenced buffer containing the physical buffer that the size
+// bytes at off are in, reading the parts of it that are needed from disk if
+// they aren't already cached. The caller must release it with putbuf.
+// Returns nil if the read failed.
+Buf* getbuf(hammer2_off_t off, int size) {
+	Buf *b;
+	int mask;
+
+	mask = segmask(off & HAMMER2_PBUFMASK64, size);
+	off &= HAMMER2_OFF_MASK_HI;
+	lock(&bcache);
+	for(b = bcache.hash[bufhash(off)]; b != nil; b = b->hnext) {
+		if (b->off == off) {
+			b->ref++;
+			b->used = 1;
+			if ((b->valid & mask) == mask)
+				bcache.hits++;
+			else
+				bcache.partial++;
+			unlock(&bcache);
+
+			// Wait for anyone else who is still reading it in.
+			qlock(b);
+			if (fillbuf(b, mask) < 0) {
+				qunlock(b);
+				putbuf(b);
+				return nil;
+			}
+			qunlock(b);
+			return b;
+		}
+	}
+	bcache.misses++;
+	b = victim();
+	if (b == nil) {
+		// Everything is in use, so fall back to a buffer which is
+		// freed as soon as it's released.
+		bcache.nocache++;
+		unlock(&bcache);
+		b = emalloc9p(sizeof(Buf));
+		b->data = emalloc9p(HAMMER2_PBUFSIZE);
+		b->off = off;
+		b->ref = 1;
+		b->nocache = 1;
+		if (fillbuf(b, mask) < 0) {
+			putbuf(b);
+			return nil;
+		}
+		return b;
+	}
+	b->off = off;
+	b->ref = 1;
+	b->used = 1;
+	b->valid = 0;
+	b->testedgood = 0;
+	b->hnext = bcache.hash[bufhash(off)];
+	bcache.hash[bufhash(off)] = b;
+
+	// Hold the buffer's lock until it's loaded so that anyone else
+	// looking for the same buffer waits for this read instead of
+	// issuing their own.
+	qlock(b);
+	unlock(&bcache);
+
+	if (b->data == nil) {
+		b->data = emalloc9p(HAMMER2_PBUFSIZE);
+	}
+	if (fillbuf(b, mask) < 0) {
+		qunlock(b);
+		putbuf(b);
+		return nil;
+	}
+	qunlock(b);
+	return b;
+}
+
+void putbuf(Buf *b) {
+	lock(&bcache);
+	assert(b->ref > 0);
+	b->ref--;
+	if (b->nocache && b->ref == 0) {
+		unlock(&bcache);
+		free(b->data);
+		free(b);
+		return;
+	}
+	unlock(&bcache);
+}
+
+// Adds a reference to b, which must already be referenced.
+void dupbuf(Buf *b) {
+	lock(&bcache);
+	assert(b->ref > 0);
+	b->ref++;
+	unlock(&bcache);
+}
+
+static void countcheck(hammer2_blockref_t *block, int skipped) {
+	int check;
+
+	check = HAMMER2_DEC_CHECK(block->methods);
+	if (check > HAMMER2_CHECK_FREEMAP) {
+		return;
+	}
+	lock(&vstats);
+	if (skipped) {
+		vstats.skipped[check]++;
+		vstats.skippedbytes += 1<<(block->data_off & HAMMER2_OFF_MASK_RADIX);
+	} else {
+		vstats.checked[check]++;
+	}
+	unlock(&vstats);
+}
+
+// Verifies the check code of block, which must be in b. Like the
+// HAMMER2_CHAIN_TESTEDGOOD flag in DragonFly, b remembers which of its blocks
+// have been tested so that a block is only verified once each time it's read
+// from disk. The buffer's testedgood mask has one bit for each 1KB that a block
+// can start at, along with the size and check code of the block that was
+// tested there. Blocks smaller than that are always checked.
+int verifyblock(Buf *b, hammer2_blockref_t *block) {
+	int radix, slot;
+	u32int check;
+
+	radix = block->data_off & HAMMER2_OFF_MASK_RADIX;
+	slot = (block->data_off & HAMMER2_OFF_MASK_LO) >> 10;
+	memcpy(&check, block->check.buf, sizeof(check));
+	if (radix >= 10 && !b->nocache) {
+		lock(&bcache);
+		// Only skip it if it's the same block that was tested, not
+		// just one that starts in the same place.
+		if ((b->testedgood & (1ULL<<slot)) && b->testedradix[slot] == radix && b->testedcheck[slot] == check) {
+			unlock(&bcache);
+			countcheck(block, 1);
+			return 1;
+		}
+		unlock(&bcache);
+	}
+	if (!verifycheck(block, &b->data[block->data_off & HAMMER2_OFF_MASK_LO])) {
+		return 0;
+	}
+	countcheck(block, 0);
+	if (radix >= 10 && !b->nocache) {
+		lock(&bcache);
+		b->testedgood |= 1ULL<<slot;
+		b->testedradix[slot] = radix;
+		b->testedcheck[slot] = check;
+		unlock(&bcache);
+	}
+	return 1;
+}
+
+// Counts a check skipped because the decompressed data for block was
+// cached, which only happens after it's been verified.
+void skippedcheck(hammer2_blockref_t *block) {
+	countcheck(block, 1);
+}
+
+void verifystats(void) {
+	static char *names[] = HAMMER2_CHECK_STRINGS;
+	uvlong checked[HAMMER2_CHECK_FREEMAP+1];
+	uvlong skipped[HAMMER2_CHECK_FREEMAP+1];
+	uvlong skippedbytes;
+	int i;
+
+	lock(&vstats);
+	memcpy(checked, vstats.checked, sizeof(checked));
+	memcpy(skipped, vstats.skipped, sizeof(skipped));
+	skippedbytes = vstats.skippedbytes;
+	unlock(&vstats);
+
+	for(i = HAMMER2_CHECK_ISCSI32; i < HAMMER2_CHECK_FREEMAP; i++) {
+		if (checked[i] == 0 && skipped[i] == 0)
+			continue;
+		print("%s checks\t%ulld (%ulld skipped)\n", names[i], checked[i], skipped[i]);
+	}
+	print("skipped check bytes\t%ulld\n", skippedbytes);
+}
+
+void bcachestats(void) {
+	int i, inuse, ref;
+	uvlong hits, partial, misses, evictions, nocache, reads, bytesread;
+
+	inuse = 0;
+	ref = 0;
+	lock(&bcache);
+	for(i = 0; i < bcache.nbuf; i++) {
+		if (bcache.bufs[i].off != HAMMER2_OFF_BAD)
+			inuse++;
+		if (bcache.bufs[i].ref > 0)
+			ref++;
+	}
+	hits = bcache.hits;
+	partial = bcache.partial;
+	misses = bcache.misses;
+	evictions = bcache.evictions;
+	nocache = bcache.nocache;
+	reads = bcache.reads;
+	bytesread = bcache.bytesread;
+	unlock(&bcache);
+
+	print("raw buffers\t%d/%d (%ulld bytes)\n", inuse, bcache.nbuf, (uvlong)inuse*HAMMER2_PBUFSIZE);
+	print("referenced\t%d\n", ref);
+	print("hits\t%ulld\n", hits);
+	print("partial hits\t%ulld\n", partial);
+	print("misses\t%ulld\n", misses);
+	if (hits + partial + misses > 0)
+		print("hit rate\t%ulld%%\n", hits*100/(hits+partial+misses));
+	print("evictions\t%ulld\n", evictions);
+	print("uncached\t%ulld\n", nocache);
+	print("disk reads\t%ulld (%ulld bytes)\n", reads, bytesread);
+}
+
+static int dbufhash(DCache *c, hammer2_off_t data_off) {
+	// Blocks are allocated in units of at least 1KB.
+	return (data_off >> 10) % c->nhash;
+}
+
+static void dbufunlink(DCache *c, DBuf *d) {
+	if (d->prev != nil)
+		d->prev->next = d->next;
+	else
+		c->head = d->next;
+	if (d->next != nil)
+		d->next->prev = d->prev;
+	else
+		c->tail = d->prev;
+	d->prev = nil;
+	d->next = nil;
+}
+
+static void dbuffront(DCache *c, DBuf *d) {
+	d->prev = nil;
+	d->next = c->head;
+	if (c->head != nil)
+		c->head->prev = d;
+	c->head = d;
+	if (c->tail == nil)
+		c->tail = d;
+}
+
+static void dbuffree(DCache *c, DBuf *d) {
+	DBuf **l;
+
+	for(l = &c->hash[dbufhash(c, d->data_off)]; *l != nil; l = &(*l)->hnext) {
+		if (*l == d) {
+			*l = d->hnext;
+			break;
+		}
+	}
+	dbufunlink(c, d);
+	c->size -= d->size;
+	c->count--;
+	free(d->data);
+	free(d);
+}
+
+static u64int dbufcheck(hammer2_blockref_t *block) {
+	u64int check;
+
+	memcpy(&check, block->check.buf, sizeof(check));
+	return check;
+}
+
+static DBuf* dclook(DCache *c, hammer2_blockref_t *block) {
+	DBuf *d;
+
+	lock(c);
+	for(d = c->hash[dbufhash(c, block->data_off)]; d != nil; d = d->hnext) {
+		if (d->data_off == block->data_off && d->methods == block->methods && d->check == dbufcheck(block)) {
+			d->ref++;
+			dbufunlink(c, d);
+			dbuffront(c, d);
+			c->hits++;
+			unlock(c);
+			return d;
+		}
+	}
+	c->misses++;
+	unlock(c);
+	return nil;
+}
+
+static void dcadd(DCache *c, hammer2_blockref_t *block, void *data, int size) {
+	DBuf *d, *prev;
+	int h;
+
+	if (size <= 0 || size > c->maxsize) {
+		return;
+	}
+	lock(c);
+	h = dbufhash(c, block->data_off);
+	for(d = c->hash[h]; d != nil; d = d->hnext) {
+		if (d->data_off == block->data_off && d->methods == block->methods && d->check == dbufcheck(block)) {
+			// Someone else got here first.
+			unlock(c);
+			return;
+		}
+	}
+	for(d = c->tail; d != nil && c->size + size > c->maxsize; d = prev) {
+		prev = d->prev;
+		if (d->ref == 0) {
+			c->evictions++;
+			dbuffree(c, d);
+		}
+	}
+	if (c->size + size > c->maxsize) {
+		unlock(c);
+		return;
+	}
+
+	d = emalloc9p(sizeof(DBuf));
+	d->data = emalloc9p(size);
+	memcpy(d->data, data, size);
+	d->size = size;
+	d->data_off = block->data_off;
+	d->methods = block->methods;
+	d->check = dbufcheck(block);
+	d->cache = c;
+	d->hnext = c->hash[h];
+	c->hash[h] = d;
+	dbuffront(c, d);
+	c->size += size;
+	c->count++;
+	c->bytesin += 1<<(block->data_off & HAMMER2_OFF_MASK_RADIX);
+	c->bytesout += size;
+	unlock(c);
+}
+
+// Returns a referenced copy of the decompressed contents of block, or nil if
+// it isn't cached. The caller must release it with putdbuf.
+DBuf* lookdbuf(hammer2_blockref_t *block) {
+	return dclook(&dcache, block);
+}
+
+// Adds size bytes of decompressed data for block to the cache, evicting the
+// least recently used blocks that aren't referenced to make room for it.
+void adddbuf(hammer2_blockref_t *block, void *data, int size) {
+	dcadd(&dcache, block, data, size);
+}
+
+// Like lookdbuf and adddbuf, but for the blockref tables of indirect blocks
+// in the node cache.
+DBuf* looknbuf(hammer2_blockref_t *block) {
+	return dclook(&ncache, block);
+}
+
+void addnbuf(hammer2_blockref_t *block, void *data, int size) {
+	dcadd(&ncache, block, data, size);
+}
+
+void putdbuf(DBuf *d) {
+	DCache *c = d->cache;
+
+	lock(c);
+	assert(d->ref > 0);
+	d->ref--;
+	unlock(c);
+}
+
+static void dcstats(DCache *c) {
+	uvlong size, maxsize, hits, misses, evictions, bytesin, bytesout;
+	int count;
+
+	lock(c);
+	size = c->size;
+	maxsize = c->maxsize;
+	count = c->count;
+	hits = c->hits;
+	misses = c->misses;
+	evictions = c->evictions;
+	bytesin = c->bytesin;
+	bytesout = c->bytesout;
+	unlock(c);
+
+	print("%s blocks\t%d (%ulld/%ulld bytes)\n", c->name, count, size, maxsize);
+	print("%s hits\t%ulld\n", c->name, hits);
+	print("%s misses\t%ulld\n", c->name, misses);
+	if (hits + misses > 0)
+		print("%s hit rate\t%ulld%%\n", c->name, hits*100/(hits+misses));
+	print("%s evictions\t%ulld\n", c->name, evictions);
+	print("%s\t%ulld raw bytes to %ulld bytes\n", c->name, bytesin, bytesout);
+}
+
+void dcachestats(void) {
+	dcstats(&dcache);
+	dcstats(&ncache);
+}
+
+static void dcflush(DCache *c) {
+	DBuf *d, *next;
+
+	lock(c);
+	for(d = c->head; d != nil; d = next) {
+		next = d->next;
+		if (d->ref == 0) {
+			dbuffree(c, d);
+		}
+	}
+	// Anything still referenced is unhashed so it can't be found again,
+	// and is freed when it falls off the end of the LRU list.
+	memset(c->hash, 0, c->nhash*sizeof(DBuf*));
+	for(d = c->head; d != nil; d = d->next)
+		d->hnext = nil;
+	unlock(c);
+}
+
+// Throws away everything in the buffer, decompressed and node caches, after
+// the volume has changed underneath us and blocks may have been freed and
+// reused. Buffers that are still referenced keep their contents until
+// they're released, but can't be found by getbuf again.
+void flushcaches(void) {
+	Buf *b;
+	int i;
+
+	lock(&bcache);
+	memset(bcache.hash, 0, bcache.nhash*sizeof(Buf*));
+	for(i = 0; i < bcache.nbuf; i++) {
+		b = &bcache.bufs[i];
+		b->hnext = nil;
+		b->used = 0;
+		if (b->ref == 0) {
+			b->off = HAMMER2_OFF_BAD;
+			b->valid = 0;
+			b->testedgood = 0;
+		}
+	}
+	unlock(&bcache);
+	dcflush(&dcache);
+	dcflush(&ncache);
+}
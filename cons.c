@@ -7,6 +7,20 @@
 #include "hammer2_disk.h"
 
 extern hammer2_volume_data_t volumehdr;
+void bcachestats(void);
+void dcachestats(void);
+void verifystats(void);
+void iostats(void);
+void inodestats(void);
+void attrstats(void);
+void statcachestats(void);
+void namecachestats(void);
+void allocstats(void);
+void sidecarstats(void);
+void loadstats(void);
+void poolstats(void);
+void priostats(void);
+char* setprioweight(char *name, int weight);
 
 // This is mostly adapted from hjfs.
 enum {MAXARGS = 16};
@@ -44,15 +58,46 @@ void cmddf(int, char**) {
 	print("\t");
 	print("%ulld%%\n", 100-(volumehdr.allocator_free*100/volumehdr.allocator_size));
 }
+void cmdcache(int, char**) {
+	bcachestats();
+	dcachestats();
+	verifystats();
+	loadstats();
+	poolstats();
+	iostats();
+	inodestats();
+	attrstats();
+	statcachestats();
+	namecachestats();
+	allocstats();
+	sidecarstats();
+}
+void cmdprio(int argc, char **argv) {
+	char *err;
+
+	if (argc == 3) {
+		err = setprioweight(argv[1], atoi(argv[2]));
+		if (err != nil) {
+			print("%s\n", err);
+			return;
+		}
+	}
+	priostats();
+}
 void cmdhelp(int, char**) {
 	print("Command\tDescription\n");
+	print("cache\tShow cache, index and allocator statistics\n");
 	print("df\tShow free disk space\n");
 	print("help\tThis message\n");
+	print("prio [class weight]\tShow or set the share of the workers and disk for meta, data, ahead or scrub work\n");
 }
 
 Cmd cmds[] = {
+	{ "cache", 0, cmdcache},
 	{ "df", 0, cmddf},
 	{ "help", 0, cmdhelp},
+	{ "prio", 0, cmdprio},
+	{ "prio", 2, cmdprio},
 };
 
 static Biobuf bio;
@@ -76,15 +121,11 @@ static void consproc(void *v){
 			goto good;
 		}
 		for(c = cmds; c < cmds + nelem(cmds); c++) {
-			if(strcmp(c->name, args[0]) == 0) {
-				if (c->nargs != rc-1)
-					goto bad;
+			if(strcmp(c->name, args[0]) == 0 && c->nargs == rc-1) {
 				c->f(rc, args);
 				goto good;
 			}
 		}
-
-	bad:
 		print("bad command: %s\n", s);
 	good:
 		free(s);
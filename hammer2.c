@@ -53,8 +53,55 @@ void dumpblock(hammer2_blockref_t *b) {
 	fprintf(stderr, "(if applicable) data_count %d inode_count: %d\n", b->embed.stats.data_count, b->embed.stats.inode_count);
 }
 
+// Returns why the volume header vol is not valid, or nil if it is.
+static char* checkvolhdr(hammer2_volume_data_t *vol) {
+	if(vol->magic != HAMMER2_VOLUME_ID_HBO)
+		return "bad magic";
+	if(icrc32(vol, 512-4) != vol->icrc_sects[7])
+		return "Invalid CRC for volume header sector 1";
+	if(icrc32(&vol->sroot_blockset, 512) != vol->icrc_sects[6])
+		return "Invalid CRC for superoot block";
+	/*
+	These seem to always be 0 on real DragonFly systems, despite
+	the documentation in hammer2_disk.h claiming otherwise.
+	if(icrc32(vol->sector2, 512) != vol->icrc_sects[5])
+		return "Invalid CRC for volume sector 2";
+	if(icrc32(vol->sector3, 512) != vol->icrc_sects[4])
+		return "Invalid CRC for volume sector 3";
+	if(icrc32(&vol->freemap_blockset, 512) != vol->icrc_sects[3])
+		return "Invalid CRC for volume freemap";
+	// sector 5? 6? 7?
+	*/
+	if(icrc32(vol, sizeof(hammer2_volume_data_t)-4) != vol->icrc_volheader)
+		return "Invalid full volume header CRC";
+	return nil;
+}
+
+// Returns the highest mirror_tid of the valid volume headers on fd, or 0 if
+// none of them are valid. The headers are checked by the same rules as
+// readvolume uses, so that a header it would skip can't look like a change.
+hammer2_tid_t volumetid(int fd) {
+	hammer2_volume_data_t *vol;
+	hammer2_tid_t tid;
+	int i;
+
+	vol = emalloc9p(sizeof(hammer2_volume_data_t));
+	tid = 0;
+	for(i = 0; i < 4; i++){
+		if(pread(fd, vol, sizeof(hammer2_volume_data_t), i*HAMMER2_ZONE_BYTES64) != sizeof(hammer2_volume_data_t))
+			continue;
+		if(checkvolhdr(vol) != nil)
+			continue;
+		if(vol->mirror_tid > tid)
+			tid = vol->mirror_tid;
+	}
+	free(vol);
+	return tid;
+}
+
 void readvolume(int fd, hammer2_dev_t *hd) {
 	hammer2_volume_data_t vol;
+	char *err;
 	int valid;
 	int i;
 	valid = 0;
@@ -66,34 +113,9 @@ void readvolume(int fd, hammer2_dev_t *hd) {
 		// printf("good magic");
 		// printf(" Total size: %u Free: %u\n", vol.allocator_size, vol.allocator_free);
 		// printf("Mirror_tid: %16d\n", vol.mirror_tid);
-		if(icrc32(&vol, 512-4) != vol.icrc_sects[7]) {
-			fprint(2,"Invalid CRC for volume header sector 1\n");
-			continue;
-		}
-		if(icrc32(&vol.sroot_blockset, 512) != vol.icrc_sects[6]) {
-			fprint(2,"Invalid CRC for superoot block\n");
-			continue;
-		}
-		/*
-		These seem to always be 0 on real DragonFly systems, despite
-		the documentation in hammer2_disk.h claiming otherwise.
-		if(icrc32(vol.sector2, 512) != vol.icrc_sects[5]) {
-			fprint(2,"Invalid CRC for volume sector 2 got %ux want %x\n", icrc32(vol.sector2, 512), vol.icrc_sects[5]);
-			continue;
-		}
-		if(icrc32(vol.sector3, 512) != vol.icrc_sects[4]) {
-			fprint(2,"Invalid CRC for volume sector 3\n");
-			continue;
-		}
-		if(icrc32(&vol.freemap_blockset, 512) != vol.icrc_sects[3]) {
-			fprint(2,"Invalid CRC for volume freemap got %ux want %ux\n", icrc32(&vol.freemap_blockset, 512), vol.icrc_sects[3]);
-			continue;
-		}
-		// sector 5? 6? 7?
-		*/
-
-		if(icrc32(&vol, sizeof(hammer2_volume_data_t)-4) != vol.icrc_volheader) {
-			fprint(2, "Invalid full volume header CRC\n");
+		err = checkvolhdr(&vol);
+		if(err != nil) {
+			fprint(2, "%s\n", err);
 			continue;
 		}
 		if(valid == 0 || hd->voldata.mirror_tid < vol.mirror_tid){
@@ -15,6 +15,10 @@
 extern char *filename;
 extern root_t root;
 extern int devfd;
+extern uvlong bcachesize;
+extern uvlong dcachesize;
+extern char *sidecarfile;
+extern int nworkers;
 
 void mythreadpostmountsrv(Srv *s, char *name, char *mtpt, int flag);
 
@@ -27,10 +31,11 @@ static Srv fs = {
 	.walk1 = fswalk,
 	.clone = fswalkclone,
 	.stat = fsstat,
+	.destroyfid = fsdestroyfid,
 };
 
 void usage(void) {
-	fprint(2, "usage: %s [-r root] [-S srvname] [-f devicename]\n", argv0);
+	fprint(2, "usage: %s [-r root] [-S srvname] [-f devicename] [-m cachemb] [-z decompcachemb] [-i sidecar] [-w workers]\n", argv0);
 }
 
 void threadmain(int argc, char *argv[])
@@ -50,6 +55,18 @@ void threadmain(int argc, char *argv[])
 	case 'r':
 		root.pfsname = EARGF(usage());
 		break;
+	case 'm':
+		bcachesize = atoll(EARGF(usage()))*1024*1024;
+		break;
+	case 'z':
+		dcachesize = atoll(EARGF(usage()))*1024*1024;
+		break;
+	case 'i':
+		sidecarfile = EARGF(usage());
+		break;
+	case 'w':
+		nworkers = atoi(EARGF(usage()));
+		break;
 	default:
 		usage();
 	}ARGEND;
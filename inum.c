@@ -0,0 +1,139 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <thread.h>
+#include <9p.h>
+
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+// The inode index maps inode numbers to the locators of the inodes that have
+// been looked up so far. Inode numbers in a long lived PFS are sparse and can
+// be very large, so rather than an array indexed by inum, it's an open
+// addressing hash table with linear probing. Each slot only holds a packed Loc
+// instead of the whole 128-byte blockref, and since an inode's key is its
+// inum, the Loc's key is the slot's inum. It's shared by every worker, so
+// lookups hold it read locked and changes write locked.
+typedef struct {
+	Loc;
+} ISlot;
+
+static struct {
+	RWLock;
+	ISlot *slots;
+	// Always a power of two.
+	uvlong cap;
+	uvlong count;
+} itab;
+
+void packloc(hammer2_blockref_t *block, Loc *l) {
+	l->data_off = block->data_off;
+	l->key = block->key;
+	memcpy(l->check, block->check.buf, sizeof(l->check));
+	l->methods = block->methods;
+	l->keybits = block->keybits;
+	l->type = block->type;
+}
+
+// Fills in the fields of block that are needed to find, load and verify what
+// l locates.
+void unpackloc(Loc *l, hammer2_blockref_t *block) {
+	memset(block, 0, sizeof(hammer2_blockref_t));
+	block->type = l->type;
+	block->data_off = l->data_off;
+	block->key = l->key;
+	block->keybits = l->keybits;
+	block->methods = l->methods;
+	memcpy(block->check.buf, l->check, sizeof(l->check));
+}
+
+static uvlong inumhash(hammer2_tid_t inum) {
+	// Fibonacci hashing, so that sequential inums are spread out.
+	return (inum * 0x9E3779B97F4A7C15ULL) & (itab.cap - 1);
+}
+
+// A slot is empty if its data_off is 0, which is where the volume header is,
+// so no inode can be there.
+static ISlot* findslot(hammer2_tid_t inum) {
+	uvlong i;
+
+	for(i = inumhash(inum); ; i = (i + 1) & (itab.cap - 1)) {
+		if (itab.slots[i].data_off == 0 || itab.slots[i].key == inum)
+			return &itab.slots[i];
+	}
+}
+
+void initinodes(uvlong hint) {
+	itab.cap = 64;
+	while(itab.cap < hint*2)
+		itab.cap *= 2;
+	itab.slots = emalloc9p(itab.cap*sizeof(ISlot));
+	itab.count = 0;
+}
+
+// Forgets every inode that has been looked up.
+void clearinodes(void) {
+	wlock(&itab);
+	memset(itab.slots, 0, itab.cap*sizeof(ISlot));
+	itab.count = 0;
+	wunlock(&itab);
+}
+
+// Must be called with itab wlocked.
+static void growinodes(void) {
+	ISlot *old;
+	uvlong oldcap, i;
+
+	old = itab.slots;
+	oldcap = itab.cap;
+	itab.cap *= 2;
+	itab.slots = emalloc9p(itab.cap*sizeof(ISlot));
+	for(i = 0; i < oldcap; i++) {
+		if (old[i].data_off != 0)
+			*findslot(old[i].key) = old[i];
+	}
+	free(old);
+}
+
+// Looks up inum in the index. Returns 1 and fills in l if it's there.
+int lookinode(hammer2_tid_t inum, Loc *l) {
+	ISlot *s;
+
+	rlock(&itab);
+	s = findslot(inum);
+	if (s->data_off == 0) {
+		runlock(&itab);
+		return 0;
+	}
+	*l = s->Loc;
+	runlock(&itab);
+	return 1;
+}
+
+void addinode(hammer2_tid_t inum, hammer2_blockref_t *block) {
+	ISlot *s;
+
+	wlock(&itab);
+	// Keep the load factor under 3/4 so that probes stay short.
+	if ((itab.count+1)*4 > itab.cap*3)
+		growinodes();
+	s = findslot(inum);
+	if (s->data_off == 0)
+		itab.count++;
+	packloc(block, s);
+	s->key = inum;
+	wunlock(&itab);
+}
+
+void inodestats(void) {
+	uvlong count, cap;
+
+	rlock(&itab);
+	count = itab.count;
+	cap = itab.cap;
+	runlock(&itab);
+	print("inodes\t%ulld in %ulld slots\n", count, cap);
+	print("inode index\t%ulld bytes (%d per slot)\n", cap*sizeof(ISlot), (int)sizeof(ISlot));
+}
@@ -0,0 +1,476 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <thread.h>
+#include <9p.h>
+
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+// Blocks are loaded by a pipeline of two pools of procs connected by
+// channels. Reader procs get the physical buffer a block is in from the
+// buffer cache, reading it from disk if they have to, and hand it to the
+// decoder procs, which verify and decompress it and send the result back to
+// whoever asked for it. While a decoder is hashing or inflating one block,
+// the readers are already waiting on the disk for the next ones.
+//
+// Reads of buffers that the caller verifies itself, like the indirect blocks
+// of a walk and the batches of inodes of a listing, go through the same queue
+// but skip the decoders and are handed straight back with the buffer held.
+//
+// Blocks that are read ahead go through the same pipeline without anyone
+// waiting for them, so by the time a sequential reader gets to them they've
+// been read and verified, and if they're compressed they're waiting in the
+// decompressed cache. Compressed ones are in flight while they're queued, so
+// a reader who gets to one first waits for it instead of decompressing it
+// again.
+//
+// Reads wait for a reader in an elevator queue sorted by physical offset
+// rather than in the order they were asked for. Readers take them in sweeps
+// up the disk, and every read that's queued for the same physical buffer is
+// done with the same getbuf, so they're merged into a single read of the
+// segments they cover. A read that someone is waiting for is taken out of
+// turn if it's been waiting for more than IODEADLINE, so that a long sweep
+// of readahead can't hold it up for long.
+//
+// Each read is queued in the class of work of whoever asked for it. Readers
+// choose which class to serve next by weighted fair queuing between the
+// classes that have reads waiting, and sweep within that class, so that
+// readahead for a big file doesn't get all of the disk while someone is
+// waiting for an inode.
+enum {
+	// The most blocks that can be waiting to be read ahead.
+	NIOAHEAD = 256,
+	// How long a demand read can wait for the sweep to get to it, in
+	// nanoseconds.
+	IODEADLINE = 50*1000*1000,
+};
+
+typedef struct IOReq IOReq;
+struct IOReq {
+	hammer2_blockref_t block;
+	void *dst;
+	int dstsize;
+
+	// The physical range to read, when it was queued and its class of
+	// work.
+	hammer2_off_t off;
+	int len;
+	vlong queued;
+	int prio;
+	IOReq *next;
+
+	Buf *b;
+	int size;
+	char *err;
+
+	// Where to send the request when it's done, or nil if it was read
+	// ahead and nobody is waiting for it. Raw requests are sent there as
+	// soon as they're read, holding b.
+	Channel *done;
+	int raw;
+	// The flight of a compressed block that's read ahead, which anyone
+	// who needs it waits for.
+	Flight *flight;
+};
+
+static struct {
+	QLock;
+	Rendez nonempty;
+
+	// Sorted by off.
+	IOReq *head;
+	int depth;
+	int nprio[NPRIO];
+	// Where the current sweep is up to.
+	hammer2_off_t pos;
+	// The virtual time, and when each class's last read would have
+	// finished in it.
+	uvlong vtime;
+	uvlong finish[NPRIO];
+
+	int maxdepth;
+	uvlong reads;
+	uvlong merged;
+	uvlong sweeps;
+	uvlong expired;
+	uvlong served[NPRIO];
+} ioq;
+
+static struct {
+	Channel *decodec;
+} io;
+
+static struct {
+	Lock;
+	uvlong loads;
+	uvlong raws;
+	uvlong readerrs;
+	// Readahead.
+	uvlong queued;
+	uvlong dropped;
+	uvlong done;
+} ios;
+
+// Adds r to the queue in offset order. Returns 0 without queueing it if it's
+// readahead and there's already too much readahead queued.
+static int ioqueue(IOReq *r) {
+	IOReq **l;
+
+	if (!r->raw) {
+		r->off = r->block.data_off & HAMMER2_OFF_MASK;
+		r->len = 1<<(r->block.data_off & HAMMER2_OFF_MASK_RADIX);
+	}
+	r->queued = nsec();
+	r->prio = r->done == nil ? PAhead : getprio();
+	qlock(&ioq);
+	if (r->done == nil && ioq.nprio[PAhead] >= NIOAHEAD) {
+		qunlock(&ioq);
+		return 0;
+	}
+	ioq.nprio[r->prio]++;
+	for(l = &ioq.head; *l != nil && (*l)->off <= r->off; l = &(*l)->next)
+		;
+	r->next = *l;
+	*l = r;
+	ioq.depth++;
+	if (ioq.depth > ioq.maxdepth)
+		ioq.maxdepth = ioq.depth;
+	rwakeup(&ioq.nonempty);
+	qunlock(&ioq);
+	return 1;
+}
+
+// Takes the next read off the queue, along with every other read for the
+// same physical buffer, and returns them as a list. Must be called with ioq
+// locked.
+static IOReq* ionext(void) {
+	IOReq *r, *p, *oldest, **l, *batch, **tail;
+	hammer2_off_t buf;
+	uvlong start, best;
+	vlong now;
+	int i, prio;
+
+	while(ioq.head == nil)
+		rsleep(&ioq.nonempty);
+
+	// Anyone who has been waiting too long for data or metadata goes
+	// first.
+	now = nsec();
+	oldest = nil;
+	for(r = ioq.head; r != nil; r = r->next) {
+		if (r->prio <= PData && now - r->queued > IODEADLINE && (oldest == nil || r->queued < oldest->queued))
+			oldest = r;
+	}
+	if (oldest != nil) {
+		r = oldest;
+		prio = r->prio;
+		ioq.expired++;
+	} else {
+		// Otherwise pick the class whose next read would finish
+		// first. A class that had nothing queued doesn't get credit
+		// for the time it was idle.
+		prio = -1;
+		best = 0;
+		for(i = 0; i < NPRIO; i++) {
+			if (ioq.nprio[i] == 0)
+				continue;
+			start = ioq.finish[i] > ioq.vtime ? ioq.finish[i] : ioq.vtime;
+			if (prio < 0 || start < best) {
+				prio = i;
+				best = start;
+			}
+		}
+		// And carry on up the disk from where the sweep is, starting
+		// again from the bottom when we get to the top.
+		for(r = ioq.head; r != nil && (r->off < ioq.pos || r->prio != prio); r = r->next)
+			;
+		if (r == nil) {
+			for(r = ioq.head; r->prio != prio; r = r->next)
+				;
+			ioq.sweeps++;
+		}
+	}
+	start = ioq.finish[prio] > ioq.vtime ? ioq.finish[prio] : ioq.vtime;
+	ioq.vtime = start;
+	ioq.finish[prio] = start + PRIOSCALE/prioweight(prio);
+	ioq.served[prio]++;
+	buf = r->off & HAMMER2_OFF_MASK_HI;
+	ioq.pos = r->off;
+
+	batch = nil;
+	tail = &batch;
+	for(l = &ioq.head; *l != nil; ) {
+		p = *l;
+		if ((p->off & HAMMER2_OFF_MASK_HI) != buf) {
+			l = &p->next;
+			continue;
+		}
+		*l = p->next;
+		p->next = nil;
+		*tail = p;
+		tail = &p->next;
+		ioq.depth--;
+		ioq.nprio[p->prio]--;
+	}
+	ioq.reads++;
+	for(p = batch->next; p != nil; p = p->next)
+		ioq.merged++;
+	return batch;
+}
+
+static void readproc(void*) {
+	IOReq *batch, *r, *next;
+	hammer2_off_t start, end;
+	Buf *b;
+
+	threadsetname("ioread");
+	for(;;) {
+		qlock(&ioq);
+		batch = ionext();
+		qunlock(&ioq);
+
+		// Only read the part of the physical buffer that the blocks
+		// are in.
+		start = batch->off;
+		end = 0;
+		for(r = batch; r != nil; r = r->next) {
+			if (r->off < start)
+				start = r->off;
+			if (r->off + r->len > end)
+				end = r->off + r->len;
+		}
+		b = getbuf(start, end - start);
+		if (b == nil) {
+			lock(&ios);
+			ios.readerrs++;
+			unlock(&ios);
+		}
+		for(r = batch; r != nil; r = next) {
+			next = r->next;
+			r->b = b;
+			if (b == nil)
+				r->err = "read error";
+			else if (r != batch)
+				dupbuf(b);
+			if (r->raw)
+				sendp(r->done, r);
+			else
+				sendp(io.decodec, r);
+		}
+	}
+}
+
+// Finishes a block that was read ahead. Uncompressed blocks only needed to be
+// in the buffer cache, but compressed ones are decompressed so that
+// decodeblock adds them to the decompressed cache, and then anyone waiting
+// for their flight takes them from there.
+static void decodeahead(IOReq *r) {
+	void *buf;
+	char *err;
+
+	err = r->err;
+	if (r->b != nil) {
+		switch(HAMMER2_DEC_COMP(r->block.methods)) {
+		case HAMMER2_COMP_NONE:
+		case HAMMER2_COMP_AUTOZERO:
+			verifyblock(r->b, &r->block);
+			break;
+		default:
+			buf = getscratch();
+			err = decodeblock(r->b, &r->block, buf, HAMMER2_PBUFSIZE, nil);
+			putscratch(buf);
+		}
+		putbuf(r->b);
+	}
+	if (r->flight != nil)
+		endflight(r->flight, err, 0);
+	lock(&ios);
+	ios.done++;
+	unlock(&ios);
+	free(r);
+}
+
+static void decodeproc(void*) {
+	IOReq *r;
+
+	threadsetname("iodecode");
+	for(;;) {
+		r = recvp(io.decodec);
+		if (r->done == nil) {
+			decodeahead(r);
+			continue;
+		}
+		if (r->b != nil) {
+			r->err = decodeblock(r->b, &r->block, r->dst, r->dstsize, &r->size);
+			putbuf(r->b);
+		}
+		sendp(r->done, r);
+	}
+}
+
+void initio(int nread, int ndecode) {
+	int i;
+
+	ioq.nonempty.l = &ioq;
+	io.decodec = chancreate(sizeof(IOReq*), 256);
+	for(i = 0; i < nread; i++) {
+		proccreate(readproc, nil, 32*1024);
+	}
+	for(i = 0; i < ndecode; i++) {
+		proccreate(decodeproc, nil, 128*1024);
+	}
+}
+
+// Loads the block pointed to at data_off into dst (after decompression), and
+// stores the size in rsize. Returns an error string if something went wrong.
+// The block is read, verified and decompressed by the pipeline's procs while
+// we wait.
+char* ioload(hammer2_blockref_t *block, void *dst, int dstsize, int *rsize) {
+	IOReq r;
+
+	memset(&r, 0, sizeof(IOReq));
+	r.block = *block;
+	r.dst = dst;
+	r.dstsize = dstsize;
+	r.done = chancreate(sizeof(IOReq*), 1);
+	lock(&ios);
+	ios.loads++;
+	unlock(&ios);
+
+	ioqueue(&r);
+	recvp(r.done);
+	chanfree(r.done);
+	if (r.err == nil && rsize != nil)
+		*rsize = r.size;
+	return r.err;
+}
+
+// Reads the physical range of size bytes at off through the queue and returns
+// the buffer it's in, which the caller must verify and release with putbuf.
+// Returns nil if it couldn't be read.
+Buf* ioreadbuf(hammer2_off_t off, int size) {
+	IOReq r;
+
+	memset(&r, 0, sizeof(IOReq));
+	r.raw = 1;
+	r.off = off;
+	r.len = size;
+	r.done = chancreate(sizeof(IOReq*), 1);
+	lock(&ios);
+	ios.raws++;
+	unlock(&ios);
+
+	ioqueue(&r);
+	recvp(r.done);
+	chanfree(r.done);
+	return r.b;
+}
+
+// Queues reads of the n physical ranges of size[i] bytes at off[i] all at
+// once, so the readers can sweep and merge them, and calls fn with the index
+// and buffer of each range in the order they finish. The buffer is nil if it
+// couldn't be read, and is released when fn returns.
+void ioreadbufs(hammer2_off_t *off, int *size, int n, void (*fn)(int, Buf*, void*), void *arg) {
+	IOReq *reqs, *r;
+	Channel *done;
+	int i;
+
+	if (n == 0) {
+		return;
+	}
+	reqs = emalloc9p(n*sizeof(IOReq));
+	done = chancreate(sizeof(IOReq*), n);
+	lock(&ios);
+	ios.raws += n;
+	unlock(&ios);
+	for(i = 0; i < n; i++) {
+		r = &reqs[i];
+		r->raw = 1;
+		r->off = off[i];
+		r->len = size[i];
+		r->done = done;
+		ioqueue(r);
+	}
+	for(i = 0; i < n; i++) {
+		r = recvp(done);
+		fn(r - reqs, r->b, arg);
+		if (r->b != nil)
+			putbuf(r->b);
+	}
+	chanfree(done);
+	free(reqs);
+}
+
+// Queues block to be read, verified and decompressed in the background. It
+// never blocks; if the queue is full the block is just not read ahead.
+void prefetch(hammer2_blockref_t *block) {
+	IOReq *r;
+
+	r = emalloc9p(sizeof(IOReq));
+	r->block = *block;
+	switch(HAMMER2_DEC_COMP(block->methods)) {
+	case HAMMER2_COMP_NONE:
+	case HAMMER2_COMP_AUTOZERO:
+		break;
+	default:
+		r->flight = startflight(block);
+		if (r->flight == nil) {
+			// Someone is already loading it.
+			free(r);
+			return;
+		}
+	}
+	if (ioqueue(r)) {
+		lock(&ios);
+		ios.queued++;
+		unlock(&ios);
+		return;
+	}
+	lock(&ios);
+	ios.dropped++;
+	unlock(&ios);
+	if (r->flight != nil) {
+		// Anyone who joined it loads it themselves.
+		endflight(r->flight, "readahead dropped", 0);
+	}
+	free(r);
+}
+
+void iostats(void) {
+	uvlong loads, raws, readerrs, queued, dropped, done;
+	uvlong reads, merged, sweeps, expired, served[NPRIO];
+	int depth, nprio[NPRIO], maxdepth, i;
+
+	qlock(&ioq);
+	depth = ioq.depth;
+	memcpy(nprio, ioq.nprio, sizeof(nprio));
+	memcpy(served, ioq.served, sizeof(served));
+	maxdepth = ioq.maxdepth;
+	reads = ioq.reads;
+	merged = ioq.merged;
+	sweeps = ioq.sweeps;
+	expired = ioq.expired;
+	qunlock(&ioq);
+
+	lock(&ios);
+	loads = ios.loads;
+	raws = ios.raws;
+	readerrs = ios.readerrs;
+	queued = ios.queued;
+	dropped = ios.dropped;
+	done = ios.done;
+	unlock(&ios);
+	print("io loads\t%ulld, %ulld raw (%ulld read errors)\n", loads, raws, readerrs);
+	print("readahead\t%ulld queued, %ulld done, %ulld dropped\n", queued, done, dropped);
+	print("io queue\t%d (%d at most)\n", depth, maxdepth);
+	for(i = 0; i < NPRIO; i++) {
+		if (nprio[i] == 0 && served[i] == 0)
+			continue;
+		print("%s io\t%ulld reads (%d waiting)\n", prioname(i), served[i], nprio[i]);
+	}
+	print("io reads\t%ulld (%ulld merged into them)\n", reads, merged);
+	print("io sweeps\t%ulld (%ulld reads past their deadline)\n", sweeps, expired);
+}
@@ -0,0 +1,264 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <thread.h>
+#include <9p.h>
+
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+// Returns the end (exclusive) of the range of keys that block covers, clipped
+// to limit.
+hammer2_key_t keyend(hammer2_blockref_t *block, hammer2_key_t limit) {
+	hammer2_key_t end;
+
+	if (block->keybits >= 64) {
+		return limit;
+	}
+	end = block->key + (1ULL<<block->keybits);
+	if (end < block->key || end > limit) {
+		// Overflowed or past the limit.
+		return limit;
+	}
+	return end;
+}
+
+// Loads the table of blockrefs in the indirect block into n. Recently visited
+// nodes are kept in the node cache. Otherwise uncompressed tables are used
+// directly from the buffer cache, and compressed ones are copied from the
+// decompressed cache by loadblock, so the node stays cached after it's
+// released with putnode and loading it again is cheap.
+char* getnode(hammer2_blockref_t *block, Node *n) {
+	int size;
+	char *err;
+
+	memset(n, 0, sizeof(Node));
+	n->dbuf = looknbuf(block);
+	if (n->dbuf != nil) {
+		// It was verified before it was added.
+		skippedcheck(block);
+		n->brefs = (hammer2_blockref_t*)n->dbuf->data;
+		n->count = n->dbuf->size / sizeof(hammer2_blockref_t);
+		return nil;
+	}
+
+	size = 1<<(block->data_off & HAMMER2_OFF_MASK_RADIX);
+	switch (HAMMER2_DEC_COMP(block->methods)) {
+	case HAMMER2_COMP_NONE:
+	case HAMMER2_COMP_AUTOZERO:
+		n->buf = ioreadbuf(block->data_off & HAMMER2_OFF_MASK, size);
+		if (n->buf == nil) {
+			return "read error";
+		}
+		if (!verifyblock(n->buf, block)) {
+			putbuf(n->buf);
+			n->buf = nil;
+			return "invalid checksum";
+		}
+		n->brefs = (hammer2_blockref_t*)&n->buf->data[block->data_off & HAMMER2_OFF_MASK_LO];
+		break;
+	default:
+		// loadblock takes it from the decompressed cache if it's
+		// there.
+		n->data = getscratch();
+		err = loadblock(block, n->data, HAMMER2_PBUFSIZE, &size);
+		if (err != nil) {
+			putscratch(n->data);
+			n->data = nil;
+			return err;
+		}
+		n->brefs = (hammer2_blockref_t*)n->data;
+	}
+	n->count = size / sizeof(hammer2_blockref_t);
+	addnbuf(block, n->brefs, size);
+	return nil;
+}
+
+void putnode(Node *n) {
+	if (n->buf != nil)
+		putbuf(n->buf);
+	if (n->dbuf != nil)
+		putdbuf(n->dbuf);
+	putscratch(n->data);
+	memset(n, 0, sizeof(Node));
+}
+
+// Finds the leaf blockref of the given type with exactly key under the
+// blockrefs in base, following only the indirect blocks whose key range
+// contains key. Returns "not found" if there isn't one.
+char* lookupkey(hammer2_blockref_t *base, int count, hammer2_key_t key, int type, hammer2_blockref_t *out) {
+	Node n, next;
+	int i, havenode;
+	char *err;
+
+	havenode = 0;
+	for(;;) {
+		for(i = 0; i < count; i++) {
+			if (base[i].type == type && base[i].key == key) {
+				*out = base[i];
+				if (havenode)
+					putnode(&n);
+				return nil;
+			}
+		}
+		for(i = 0; i < count; i++) {
+			if (base[i].type == HAMMER2_BREF_TYPE_INDIRECT
+				&& key >= base[i].key
+				&& key < keyend(&base[i], HAMMER2_KEY_MAX))
+				break;
+		}
+		if (i == count) {
+			if (havenode)
+				putnode(&n);
+			return "not found";
+		}
+		err = getnode(&base[i], &next);
+		if (havenode)
+			putnode(&n);
+		if (err != nil) {
+			return err;
+		}
+		n = next;
+		havenode = 1;
+		base = n.brefs;
+		count = n.count;
+	}
+}
+
+// Calls fn on every leaf blockref under base with a key in [beg, last],
+// descending only into the indirect blocks that overlap that range.
+char* scankeys(hammer2_blockref_t *base, int count, hammer2_key_t beg, hammer2_key_t last, void (*fn)(hammer2_blockref_t*, void*), void *arg) {
+	Node n;
+	int i;
+	char *err;
+
+	for(i = 0; i < count; i++) {
+		switch (base[i].type) {
+		case HAMMER2_BREF_TYPE_EMPTY:
+			break;
+		case HAMMER2_BREF_TYPE_INDIRECT:
+			if (base[i].key > last || keyend(&base[i], HAMMER2_KEY_MAX) <= beg)
+				break;
+			err = getnode(&base[i], &n);
+			if (err != nil) {
+				return err;
+			}
+			err = scankeys(n.brefs, n.count, beg, last, fn, arg);
+			putnode(&n);
+			if (err != nil) {
+				return err;
+			}
+			break;
+		default:
+			if (base[i].key >= beg && base[i].key <= last)
+				fn(&base[i], arg);
+		}
+	}
+	return nil;
+}
+
+static char* scanfromr(hammer2_blockref_t *base, int count, hammer2_key_t beg, int (*fn)(hammer2_blockref_t*, void*), void *arg, int *stopped) {
+	Node n;
+	int i;
+	char *err;
+
+	// The blockrefs in a node are sorted by key, so visiting them in
+	// order visits the leaves in key order.
+	for(i = 0; i < count && !*stopped; i++) {
+		switch (base[i].type) {
+		case HAMMER2_BREF_TYPE_EMPTY:
+			break;
+		case HAMMER2_BREF_TYPE_INDIRECT:
+			if (keyend(&base[i], HAMMER2_KEY_MAX) <= beg)
+				break;
+			err = getnode(&base[i], &n);
+			if (err != nil) {
+				return err;
+			}
+			err = scanfromr(n.brefs, n.count, beg, fn, arg, stopped);
+			putnode(&n);
+			if (err != nil) {
+				return err;
+			}
+			break;
+		default:
+			if (base[i].key >= beg && !fn(&base[i], arg))
+				*stopped = 1;
+		}
+	}
+	return nil;
+}
+
+// Calls fn on the leaf blockrefs under base with a key of at least beg, in
+// key order, until fn returns 0. The indirect blocks which end before beg
+// aren't visited, so a scan can be resumed from the key after the last one
+// it saw without going over what it has already seen.
+char* scanfrom(hammer2_blockref_t *base, int count, hammer2_key_t beg, int (*fn)(hammer2_blockref_t*, void*), void *arg) {
+	int stopped = 0;
+
+	return scanfromr(base, count, beg, fn, arg, &stopped);
+}
+
+// Returns the directory hash of name, as computed by hammer2_dirhash in
+// DragonFly. Directory entries are keyed by the hash of their name, so a
+// lookup only needs to visit the entries from the hash to the end of its
+// HAMMER2_DIRHASH_LOMASK collision range.
+hammer2_key_t dirhash(char *name, int len) {
+	uchar *aname = (uchar*)name;
+	u32int crcx;
+	u64int key;
+	int i, j;
+
+	key = 0;
+
+	// m32: sum of the crcs of each part of the name, split at punctuation
+	crcx = 0;
+	for(i = j = 0; i < len; i++) {
+		if (aname[i] == '.' || aname[i] == '-' || aname[i] == '_' || aname[i] == '~') {
+			if (i != j)
+				crcx += icrc32(aname + j, i - j);
+			j = i + 1;
+		}
+	}
+	if (i != j)
+		crcx += icrc32(aname + j, i - j);
+
+	// The hash is in the top 32 bits of the key, and bit 63 is always set.
+	crcx |= 0x80000000U;
+	key |= (u64int)crcx << 32;
+
+	// l16: crc of the whole name, to reduce degenerate collisions.
+	crcx = icrc32(aname, len);
+	crcx = crcx ^ (crcx << 16);
+	key |= crcx & 0xFFFF0000U;
+
+	// Bit 15 is always set, so that 0-0x7FFF are free for . and ..
+	key |= HAMMER2_DIRHASH_FORCED;
+	return key;
+}
+
+// Returns the name of the directory entry block as a NUL terminated string in
+// buf, which must be at least HAMMER2_INODE_MAXNAME+1 bytes. Names longer than
+// the 64 bytes that fit in the blockref are loaded from disk.
+char* direntname(hammer2_blockref_t *block, char *buf) {
+	int namlen, size;
+	char *err;
+
+	namlen = block->embed.dirent.namlen;
+	if (namlen > HAMMER2_INODE_MAXNAME) {
+		namlen = HAMMER2_INODE_MAXNAME;
+	}
+	if (namlen <= sizeof(block->check.buf)) {
+		memcpy(buf, block->check.buf, namlen);
+	} else {
+		err = loadblock(block, buf, HAMMER2_INODE_MAXNAME, &size);
+		if (err != nil) {
+			fprint(2, "%s\n", err);
+			namlen = 0;
+		}
+	}
+	buf[namlen] = '\0';
+	return buf;
+}
@@ -0,0 +1,234 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <thread.h>
+#include <9p.h>
+
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+// The name cache maps a name in a directory to the qid it walks to, so that
+// walking the same path again doesn't need to search the directory. Names
+// which aren't in the directory are cached too, as negative entries with a
+// qid path of 0, since the same missing names tend to be looked for over and
+// over (include paths, $path, etc.)
+//
+// It's a segmented LRU: new entries go on the probationary list, and are only
+// moved to the protected list if they're looked up again. The protected list
+// is limited to a fraction of the cache, and entries that fall off the end of
+// it go back to the front of the probationary list. A walk over a large tree
+// which looks each name up once only churns the probationary list, so it
+// doesn't flush out the names that are used all the time.
+typedef struct NEnt NEnt;
+struct NEnt {
+	hammer2_tid_t parent;
+	char *name;
+	ulong hash;
+	Qid qid;
+
+	int protected;
+	NEnt *hnext;
+	NEnt *prev;
+	NEnt *next;
+};
+
+typedef struct {
+	// Most recently used first.
+	NEnt *head;
+	NEnt *tail;
+	int count;
+} NList;
+
+static struct {
+	Lock;
+
+	NEnt **hash;
+	int nhash;
+
+	NList probation;
+	NList protected;
+	int max;
+	int maxprotected;
+
+	uvlong hits;
+	uvlong neghits;
+	uvlong misses;
+	uvlong promotions;
+	uvlong evictions;
+} names;
+
+void initnamecache(int n) {
+	if (n < 16) {
+		n = 16;
+	}
+	names.max = n;
+	names.maxprotected = n*3/4;
+	names.nhash = n;
+	names.hash = emalloc9p(n*sizeof(NEnt*));
+}
+
+static ulong namehash(hammer2_tid_t parent, char *name) {
+	ulong h;
+
+	h = parent * 0x9E3779B9UL;
+	while(*name != '\0')
+		h = h*31 + (uchar)*name++;
+	return h;
+}
+
+static void nlunlink(NList *l, NEnt *e) {
+	if (e->prev != nil)
+		e->prev->next = e->next;
+	else
+		l->head = e->next;
+	if (e->next != nil)
+		e->next->prev = e->prev;
+	else
+		l->tail = e->prev;
+	e->prev = nil;
+	e->next = nil;
+	l->count--;
+}
+
+static void nlfront(NList *l, NEnt *e) {
+	e->prev = nil;
+	e->next = l->head;
+	if (l->head != nil)
+		l->head->prev = e;
+	l->head = e;
+	if (l->tail == nil)
+		l->tail = e;
+	l->count++;
+}
+
+static void nentfree(NEnt *e) {
+	NEnt **l;
+
+	for(l = &names.hash[e->hash % names.nhash]; *l != nil; l = &(*l)->hnext) {
+		if (*l == e) {
+			*l = e->hnext;
+			break;
+		}
+	}
+	nlunlink(e->protected ? &names.protected : &names.probation, e);
+	free(e->name);
+	free(e);
+}
+
+static NEnt* nentlook(hammer2_tid_t parent, char *name, ulong h) {
+	NEnt *e;
+
+	for(e = names.hash[h % names.nhash]; e != nil; e = e->hnext) {
+		if (e->hash == h && e->parent == parent && strcmp(e->name, name) == 0)
+			return e;
+	}
+	return nil;
+}
+
+// Looks up name in the directory parent. Returns 1 and sets q if it's cached,
+// in which case a q->path of 0 means that the name isn't in the directory.
+int looknamecache(hammer2_tid_t parent, char *name, Qid *q) {
+	NEnt *e, *demote;
+	ulong h;
+
+	h = namehash(parent, name);
+	lock(&names);
+	e = nentlook(parent, name, h);
+	if (e == nil) {
+		names.misses++;
+		unlock(&names);
+		return 0;
+	}
+	*q = e->qid;
+	if (q->path == 0)
+		names.neghits++;
+	else
+		names.hits++;
+	if (e->protected) {
+		nlunlink(&names.protected, e);
+		nlfront(&names.protected, e);
+	} else {
+		// It's been used twice, so it's worth protecting.
+		nlunlink(&names.probation, e);
+		e->protected = 1;
+		nlfront(&names.protected, e);
+		names.promotions++;
+		while(names.protected.count > names.maxprotected) {
+			demote = names.protected.tail;
+			nlunlink(&names.protected, demote);
+			demote->protected = 0;
+			nlfront(&names.probation, demote);
+		}
+	}
+	unlock(&names);
+	return 1;
+}
+
+// Adds the result of looking up name in the directory parent to the cache.
+// A q.path of 0 records that it isn't there.
+void addnamecache(hammer2_tid_t parent, char *name, Qid q) {
+	NEnt *e;
+	ulong h;
+
+	h = namehash(parent, name);
+	lock(&names);
+	e = nentlook(parent, name, h);
+	if (e != nil) {
+		e->qid = q;
+		unlock(&names);
+		return;
+	}
+	while(names.probation.count + names.protected.count >= names.max) {
+		names.evictions++;
+		if (names.probation.tail != nil)
+			nentfree(names.probation.tail);
+		else
+			nentfree(names.protected.tail);
+	}
+	e = emalloc9p(sizeof(NEnt));
+	e->parent = parent;
+	e->name = estrdup9p(name);
+	e->hash = h;
+	e->qid = q;
+	e->hnext = names.hash[h % names.nhash];
+	names.hash[h % names.nhash] = e;
+	nlfront(&names.probation, e);
+	unlock(&names);
+}
+
+// Throws away every cached name.
+void flushnamecache(void) {
+	lock(&names);
+	while(names.probation.head != nil)
+		nentfree(names.probation.head);
+	while(names.protected.head != nil)
+		nentfree(names.protected.head);
+	unlock(&names);
+}
+
+void namecachestats(void) {
+	uvlong hits, neghits, misses, promotions, evictions;
+	int probation, protected, max;
+
+	lock(&names);
+	probation = names.probation.count;
+	protected = names.protected.count;
+	max = names.max;
+	hits = names.hits;
+	neghits = names.neghits;
+	misses = names.misses;
+	promotions = names.promotions;
+	evictions = names.evictions;
+	unlock(&names);
+
+	print("names\t%d/%d (%d probation, %d protected)\n", probation+protected, max, probation, protected);
+	print("name hits\t%ulld\n", hits);
+	print("name negative hits\t%ulld\n", neghits);
+	print("name misses\t%ulld\n", misses);
+	if (hits + neghits + misses > 0)
+		print("name hit rate\t%ulld%%\n", (hits+neghits)*100/(hits+neghits+misses));
+	print("name promotions\t%ulld\n", promotions);
+	print("name evictions\t%ulld\n", evictions);
+}
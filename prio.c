@@ -0,0 +1,67 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <thread.h>
+#include <9p.h>
+
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+// The class of the work a proc is doing is kept in its procdata, so that the
+// blocks it loads are queued in the same class as the request that needed
+// them without passing it down through every lookup.
+
+// In the order of the classes in 9phammer.h.
+static char *prionames[NPRIO] = { "meta", "data", "ahead", "scrub" };
+
+static Lock priolock;
+static int weights[NPRIO] = { 8, 4, 2, 1 };
+
+void setprio(int p) {
+	*procdata() = (void*)(uintptr)p;
+}
+
+// Procs which never set their class are doing metadata work for the service
+// loop.
+int getprio(void) {
+	return (uintptr)*procdata();
+}
+
+int prioweight(int p) {
+	int w;
+
+	lock(&priolock);
+	w = weights[p];
+	unlock(&priolock);
+	return w;
+}
+
+char* setprioweight(char *name, int weight) {
+	int p;
+
+	if (weight < 1 || weight > PRIOSCALE) {
+		return "weight out of range";
+	}
+	for(p = 0; p < NPRIO; p++) {
+		if (strcmp(name, prionames[p]) == 0) {
+			lock(&priolock);
+			weights[p] = weight;
+			unlock(&priolock);
+			return nil;
+		}
+	}
+	return "unknown class";
+}
+
+char* prioname(int p) {
+	return prionames[p];
+}
+
+void priostats(void) {
+	int p;
+
+	for(p = 0; p < NPRIO; p++)
+		print("%s\tweight %d\n", prionames[p], prioweight(p));
+}
@@ -0,0 +1,679 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <thread.h>
+#include <9p.h>
+
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+// The sidecar is an optional file which holds the locators of every inode in
+// the PFS and the entries of every directory, so that a restarted server can
+// find inodes and look names up without descending the PFS's trees until
+// they're warm again. It's only used if it was built from the same volume
+// (fsid), PFS and version (mirror_tid) that's mounted, and it's rebuilt in the
+// background otherwise.
+//
+// The file is a header followed by flat, fixed-size, sorted arrays, so it can
+// be used as-is after reading it into memory in one go:
+//
+//	SHdr
+//	Loc	inodes[ninodes]		sorted by key (the inum)
+//	SDir	dirs[ndirs]		sorted by inum
+//	SDirent	ents[nents]		each directory's entries sorted by key
+//	char	names[namesize]		the entries' names, not NUL terminated
+
+enum {
+	SIDECARVERS = 1,
+	BYTEORDER = 0x01020304,
+};
+
+typedef struct {
+	char magic[8];
+	u32int order;
+	u32int version;
+	uuid_t fsid;
+	hammer2_tid_t mirror_tid;
+	char pfsname[HAMMER2_INODE_MAXNAME+1];
+	u64int ninodes;
+	u64int ndirs;
+	u64int nents;
+	u64int namesize;
+} SHdr;
+
+typedef struct {
+	hammer2_tid_t inum;
+	u64int first;
+	u64int count;
+} SDir;
+
+typedef struct {
+	hammer2_key_t key;
+	hammer2_tid_t inum;
+	u32int name;
+	uchar namlen;
+	uchar type;
+} SDirent;
+
+static char sidecarmagic[8] = "h2sidecr";
+
+typedef struct Sidecar Sidecar;
+struct Sidecar {
+	Ref;
+	uchar *data;
+	SHdr *hdr;
+	Loc *inodes;
+	SDir *dirs;
+	SDirent *ents;
+	char *names;
+};
+
+typedef struct {
+	inode pfs;
+	uuid_t fsid;
+	hammer2_tid_t tid;
+} BuildArgs;
+
+static struct {
+	Lock;
+	Sidecar *cur;
+	// Whether a sidecar is being built, and the newest version that
+	// was asked for while it was.
+	int building;
+	BuildArgs *pending;
+	char *status;
+	// The version of the volume a sidecar is wanted for, or 0 if none
+	// is. Sidecars for any other version are thrown away, so that a
+	// build that finishes just as the volume changes can't install one.
+	hammer2_tid_t tid;
+
+	uvlong inodehits;
+	uvlong namehits;
+} sc;
+
+static char *sidecarpath;
+extern root_t root;
+
+static Sidecar* getsidecar(void) {
+	Sidecar *s;
+
+	lock(&sc);
+	s = sc.cur;
+	if (s != nil)
+		incref(s);
+	unlock(&sc);
+	return s;
+}
+
+static void putsidecar(Sidecar *s) {
+	if (s != nil && decref(s) == 0) {
+		free(s->data);
+		free(s);
+	}
+}
+
+// Makes s, which is for the version tid of the volume, the current sidecar,
+// unless the volume has changed since.
+static char* setsidecar(Sidecar *s, char *status, hammer2_tid_t tid) {
+	Sidecar *old;
+
+	lock(&sc);
+	if (tid != sc.tid) {
+		unlock(&sc);
+		putsidecar(s);
+		return "sidecar is out of date";
+	}
+	old = sc.cur;
+	sc.cur = s;
+	sc.status = status;
+	unlock(&sc);
+	putsidecar(old);
+	return nil;
+}
+
+// Returns 1 if a sidecar is still wanted for the version tid of the volume.
+static int wantsidecar(hammer2_tid_t tid) {
+	int r;
+
+	lock(&sc);
+	r = tid == sc.tid;
+	unlock(&sc);
+	return r;
+}
+
+// Returns an error if h isn't the header of a sidecar for the mounted volume.
+static char* checkheader(SHdr *h, uuid_t *fsid, hammer2_tid_t tid, char *pfsname) {
+	if (memcmp(h->magic, sidecarmagic, sizeof(h->magic)) != 0 || h->order != BYTEORDER || h->version != SIDECARVERS) {
+		return "not a sidecar";
+	}
+	if (memcmp(&h->fsid, fsid, sizeof(uuid_t)) != 0) {
+		return "sidecar is for another volume";
+	}
+	if (h->mirror_tid != tid) {
+		return "sidecar is out of date";
+	}
+	if (strncmp(h->pfsname, pfsname, sizeof(h->pfsname)) != 0) {
+		return "sidecar is for another pfs";
+	}
+	return nil;
+}
+
+// Sets up s to point into data, which holds size bytes read from a sidecar
+// file whose header has been checked. Returns an error if it's damaged.
+static char* parsesidecar(Sidecar *s, uchar *data, vlong size) {
+	SHdr *h;
+	SDir *d;
+	SDirent *e;
+	vlong want;
+	u64int i;
+
+	h = (SHdr*)data;
+	// None of the counts can be more than would fit in the file, so that
+	// adding up their sizes can't overflow.
+	if (h->ninodes > size/sizeof(Loc) || h->ndirs > size/sizeof(SDir) || h->nents > size/sizeof(SDirent) || h->namesize > size) {
+		return "sidecar has the wrong size";
+	}
+	want = sizeof(SHdr) + h->ninodes*sizeof(Loc) + h->ndirs*sizeof(SDir) + h->nents*sizeof(SDirent) + h->namesize;
+	if (size != want) {
+		return "sidecar has the wrong size";
+	}
+	s->data = data;
+	s->hdr = h;
+	s->inodes = (Loc*)(data + sizeof(SHdr));
+	s->dirs = (SDir*)(s->inodes + h->ninodes);
+	s->ents = (SDirent*)(s->dirs + h->ndirs);
+	s->names = (char*)(s->ents + h->nents);
+
+	// Lookups trust the offsets in it, so check them all now.
+	for(i = 0; i < h->ndirs; i++) {
+		d = &s->dirs[i];
+		if (d->first > h->nents || d->count > h->nents - d->first) {
+			return "sidecar is damaged";
+		}
+	}
+	for(i = 0; i < h->nents; i++) {
+		e = &s->ents[i];
+		if (e->name > h->namesize || e->namlen > h->namesize - e->name) {
+			return "sidecar is damaged";
+		}
+	}
+	return nil;
+}
+
+// Reads the sidecar file into memory and makes it the current sidecar if it's
+// for the mounted volume. The header is checked before the rest is read, so
+// that an out of date sidecar costs a single small read.
+static char* readsidecar(uuid_t *fsid, hammer2_tid_t tid) {
+	Sidecar *s;
+	SHdr h;
+	Dir *d;
+	uchar *data;
+	vlong size;
+	char *err;
+	int fd;
+
+	fd = open(sidecarpath, OREAD);
+	if (fd < 0) {
+		return "no sidecar";
+	}
+	d = dirfstat(fd);
+	if (d == nil) {
+		close(fd);
+		return "can't stat sidecar";
+	}
+	size = d->length;
+	free(d);
+	if (size < sizeof(SHdr) || readn(fd, &h, sizeof(SHdr)) != sizeof(SHdr)) {
+		close(fd);
+		return "sidecar too short";
+	}
+	err = checkheader(&h, fsid, tid, root.pfsname);
+	if (err != nil) {
+		close(fd);
+		return err;
+	}
+	data = emalloc9p(size);
+	memcpy(data, &h, sizeof(SHdr));
+	if (readn(fd, data + sizeof(SHdr), size - sizeof(SHdr)) != size - sizeof(SHdr)) {
+		close(fd);
+		free(data);
+		return "short read of sidecar";
+	}
+	close(fd);
+	s = emalloc9p(sizeof(Sidecar));
+	err = parsesidecar(s, data, size);
+	if (err != nil) {
+		free(data);
+		free(s);
+		return err;
+	}
+	incref(s);
+	return setsidecar(s, "loaded", tid);
+}
+
+// The state of a sidecar being built.
+typedef struct {
+	Loc *inodes;
+	u64int ninodes;
+	u64int icap;
+
+	SDir *dirs;
+	u64int ndirs;
+	u64int dcap;
+
+	SDirent *ents;
+	u64int nents;
+	u64int ecap;
+
+	char *names;
+	u64int namesize;
+	u64int ncap;
+
+	// Directories still to visit.
+	hammer2_tid_t *queue;
+	u64int qhead;
+	u64int qtail;
+	u64int qcap;
+} Build;
+
+static void addinodeloc(hammer2_blockref_t *block, void *aux) {
+	Build *b = aux;
+
+	if (block->type != HAMMER2_BREF_TYPE_INODE) {
+		return;
+	}
+	if (b->ninodes == b->icap) {
+		b->icap = b->icap == 0 ? 1024 : b->icap*2;
+		b->inodes = erealloc9p(b->inodes, b->icap*sizeof(Loc));
+	}
+	packloc(block, &b->inodes[b->ninodes++]);
+}
+
+static int loccmp(void *va, void *vb) {
+	Loc *a = va;
+	Loc *b = vb;
+
+	if (a->key < b->key)
+		return -1;
+	if (a->key > b->key)
+		return 1;
+	return 0;
+}
+
+static int sdircmp(void *va, void *vb) {
+	SDir *a = va;
+	SDir *b = vb;
+
+	if (a->inum < b->inum)
+		return -1;
+	if (a->inum > b->inum)
+		return 1;
+	return 0;
+}
+
+static Loc* findloc(Loc *inodes, u64int n, hammer2_tid_t inum) {
+	u64int lo, hi, mid;
+
+	lo = 0;
+	hi = n;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if (inodes[mid].key < inum)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < n && inodes[lo].key == inum)
+		return &inodes[lo];
+	return nil;
+}
+
+static SDir* finddir(SDir *dirs, u64int n, hammer2_tid_t inum) {
+	u64int lo, hi, mid;
+
+	lo = 0;
+	hi = n;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if (dirs[mid].inum < inum)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < n && dirs[lo].inum == inum)
+		return &dirs[lo];
+	return nil;
+}
+
+static int addsdirent(hammer2_blockref_t *block, void *aux) {
+	Build *b = aux;
+	SDirent *e;
+	char name[HAMMER2_INODE_MAXNAME+1];
+	int len;
+
+	if (block->type != HAMMER2_BREF_TYPE_DIRENT) {
+		return 1;
+	}
+	len = strlen(direntname(block, name));
+	if (b->nents == b->ecap) {
+		b->ecap = b->ecap == 0 ? 1024 : b->ecap*2;
+		b->ents = erealloc9p(b->ents, b->ecap*sizeof(SDirent));
+	}
+	if (b->namesize + len > b->ncap) {
+		b->ncap = b->ncap == 0 ? 16384 : b->ncap*2;
+		b->names = erealloc9p(b->names, b->ncap);
+	}
+	e = &b->ents[b->nents++];
+	memset(e, 0, sizeof(SDirent));
+	e->key = block->key;
+	e->inum = block->embed.dirent.inum;
+	e->type = block->embed.dirent.type;
+	e->namlen = len;
+	e->name = b->namesize;
+	memcpy(b->names + b->namesize, name, len);
+	b->namesize += len;
+
+	if (e->type == HAMMER2_OBJTYPE_DIRECTORY) {
+		if (b->qtail == b->qcap) {
+			b->qcap = b->qcap == 0 ? 256 : b->qcap*2;
+			b->queue = erealloc9p(b->queue, b->qcap*sizeof(hammer2_tid_t));
+		}
+		b->queue[b->qtail++] = e->inum;
+	}
+	return 1;
+}
+
+static void freebuild(Build *b) {
+	free(b->inodes);
+	free(b->dirs);
+	free(b->ents);
+	free(b->names);
+	free(b->queue);
+}
+
+// Writes out a sidecar with the header h and the contents of b. The header is
+// written last, so that a sidecar which was only partly written is never
+// mistaken for a good one.
+static char* writesidecar(SHdr *h, Build *b) {
+	SHdr blank;
+	int fd;
+
+	fd = create(sidecarpath, OWRITE|OTRUNC, 0644);
+	if (fd < 0) {
+		return "can't create sidecar";
+	}
+	memset(&blank, 0, sizeof(SHdr));
+	if (write(fd, &blank, sizeof(SHdr)) != sizeof(SHdr)
+		|| write(fd, b->inodes, b->ninodes*sizeof(Loc)) != b->ninodes*sizeof(Loc)
+		|| write(fd, b->dirs, b->ndirs*sizeof(SDir)) != b->ndirs*sizeof(SDir)
+		|| write(fd, b->ents, b->nents*sizeof(SDirent)) != b->nents*sizeof(SDirent)
+		|| write(fd, b->names, b->namesize) != b->namesize
+		|| pwrite(fd, h, sizeof(SHdr), 0) != sizeof(SHdr)) {
+		close(fd);
+		return "short write of sidecar";
+	}
+	close(fd);
+	return nil;
+}
+
+
+// Builds the sidecar of the PFS in args, writes it out and makes it the
+// current sidecar if the volume hasn't changed in the meantime. Gives up
+// without an error as soon as it notices that the volume has changed.
+static char* buildsidecar(BuildArgs *args) {
+	Build b;
+	SHdr h;
+	SDir *d;
+	Loc *l;
+	hammer2_blockref_t block;
+	hammer2_tid_t inum;
+	inode *in;
+	char *err;
+
+	memset(&b, 0, sizeof(Build));
+	in = emalloc9p(sizeof(inode));
+
+	// Every inode in the PFS is indexed by inum under the PFS root, below
+	// the keys of the root's directory entries.
+	err = scankeys(args->pfs.u.blockset.blockref, HAMMER2_SET_COUNT, 0, HAMMER2_DIRHASH_VISIBLE-1, addinodeloc, &b);
+	if (err != nil) {
+		goto out;
+	}
+	qsort(b.inodes, b.ninodes, sizeof(Loc), loccmp);
+
+	// Then visit every directory, starting from the root.
+	b.qcap = 256;
+	b.queue = emalloc9p(b.qcap*sizeof(hammer2_tid_t));
+	b.queue[b.qtail++] = args->pfs.meta.inum;
+	while(b.qhead < b.qtail) {
+		if (!wantsidecar(args->tid)) {
+			// There's a build for the new version waiting.
+			goto out;
+		}
+		inum = b.queue[b.qhead++];
+		if (inum == args->pfs.meta.inum) {
+			memcpy(in, &args->pfs, sizeof(inode));
+		} else {
+			l = findloc(b.inodes, b.ninodes, inum);
+			if (l == nil) {
+				continue;
+			}
+			unpackloc(l, &block);
+			err = loadblock(&block, in, sizeof(inode), nil);
+			if (err != nil) {
+				goto out;
+			}
+		}
+		if (b.ndirs == b.dcap) {
+			b.dcap = b.dcap == 0 ? 256 : b.dcap*2;
+			b.dirs = erealloc9p(b.dirs, b.dcap*sizeof(SDir));
+		}
+		d = &b.dirs[b.ndirs++];
+		d->inum = inum;
+		d->first = b.nents;
+		err = scanfrom(in->u.blockset.blockref, HAMMER2_SET_COUNT, HAMMER2_DIRHASH_VISIBLE, addsdirent, &b);
+		if (err != nil) {
+			goto out;
+		}
+		d->count = b.nents - d->first;
+	}
+	qsort(b.dirs, b.ndirs, sizeof(SDir), sdircmp);
+
+	memset(&h, 0, sizeof(SHdr));
+	memcpy(h.magic, sidecarmagic, sizeof(h.magic));
+	h.order = BYTEORDER;
+	h.version = SIDECARVERS;
+	h.fsid = args->fsid;
+	h.mirror_tid = args->tid;
+	strncpy(h.pfsname, root.pfsname, sizeof(h.pfsname)-1);
+	h.ninodes = b.ninodes;
+	h.ndirs = b.ndirs;
+	h.nents = b.nents;
+	h.namesize = b.namesize;
+	if (!wantsidecar(args->tid)) {
+		// The volume changed while we were building, and another
+		// build has been started for the new version.
+		goto out;
+	}
+	err = writesidecar(&h, &b);
+	if (err == nil) {
+		err = readsidecar(&args->fsid, args->tid);
+	}
+out:
+	if (err != nil && !wantsidecar(args->tid)) {
+		// Whatever went wrong, it doesn't matter any more.
+		err = nil;
+	}
+	freebuild(&b);
+	free(in);
+	return err;
+}
+
+// Builds sidecars one at a time, for the newest version of the volume that
+// was asked for, until there are none left to build.
+static void buildproc(void *v) {
+	BuildArgs *args;
+	char *err;
+
+	// Don't get in the way of anyone who is waiting.
+	setprio(PScrub);
+	for(args = v; args != nil; ) {
+		err = buildsidecar(args);
+		free(args);
+		lock(&sc);
+		if (err != nil) {
+			fprint(2, "building sidecar: %s\n", err);
+			sc.status = "build failed";
+		}
+		args = sc.pending;
+		sc.pending = nil;
+		if (args == nil)
+			sc.building = 0;
+		else
+			sc.status = "building";
+		unlock(&sc);
+	}
+}
+
+// Uses the sidecar file for the PFS pfs on the volume fsid at version tid if
+// it's there and up to date, or starts building a new one in the background
+// if it isn't.
+void initsidecar(char *file, inode *pfs, uuid_t *fsid, hammer2_tid_t tid) {
+	BuildArgs *args;
+
+	if (file == nil) {
+		return;
+	}
+	sidecarpath = file;
+	lock(&sc);
+	sc.tid = tid;
+	unlock(&sc);
+	setsidecar(nil, "none", tid);
+	if (readsidecar(fsid, tid) == nil) {
+		return;
+	}
+	args = emalloc9p(sizeof(BuildArgs));
+	memcpy(&args->pfs, pfs, sizeof(inode));
+	args->fsid = *fsid;
+	args->tid = tid;
+	// Only one is built at a time. If there's already one being built,
+	// it gives up when it notices it's for an older version, and this
+	// one is built next in its place.
+	lock(&sc);
+	sc.status = "building";
+	if (sc.building) {
+		free(sc.pending);
+		sc.pending = args;
+		unlock(&sc);
+		return;
+	}
+	sc.building = 1;
+	unlock(&sc);
+	proccreate(buildproc, args, 64*1024);
+}
+
+// Finds the locator of the inode inum in the sidecar. Returns 1 if it's
+// there.
+int sidecarinode(hammer2_tid_t inum, hammer2_blockref_t *block) {
+	Sidecar *s;
+	Loc *l;
+
+	s = getsidecar();
+	if (s == nil) {
+		return 0;
+	}
+	l = findloc(s->inodes, s->hdr->ninodes, inum);
+	if (l != nil) {
+		unpackloc(l, block);
+		lock(&sc);
+		sc.inodehits++;
+		unlock(&sc);
+	}
+	putsidecar(s);
+	return l != nil;
+}
+
+// Looks up name in the directory parent in the sidecar. Returns 0 if the
+// sidecar doesn't have the directory. Otherwise returns 1, with *inum set to
+// 0 if the name isn't there, or to its inum and *type to its object type if
+// it is.
+int sidecarlookup(hammer2_tid_t parent, char *name, hammer2_tid_t *inum, uchar *type) {
+	Sidecar *s;
+	SDir *d;
+	SDirent *e;
+	hammer2_key_t key;
+	u64int lo, hi, mid;
+	int len;
+
+	s = getsidecar();
+	if (s == nil) {
+		return 0;
+	}
+	d = finddir(s->dirs, s->hdr->ndirs, parent);
+	if (d == nil) {
+		putsidecar(s);
+		return 0;
+	}
+	len = strlen(name);
+	key = dirhash(name, len);
+	e = &s->ents[d->first];
+	lo = 0;
+	hi = d->count;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if (e[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*inum = 0;
+	for(; lo < d->count && e[lo].key <= key + HAMMER2_DIRHASH_LOMASK; lo++) {
+		if (e[lo].namlen == len && memcmp(s->names + e[lo].name, name, len) == 0) {
+			*inum = e[lo].inum;
+			*type = e[lo].type;
+			break;
+		}
+	}
+	lock(&sc);
+	sc.namehits++;
+	unlock(&sc);
+	putsidecar(s);
+	return 1;
+}
+
+// Stops using the sidecar, since the volume has changed.
+void dropsidecar(void) {
+	Sidecar *old;
+
+	lock(&sc);
+	old = sc.cur;
+	sc.cur = nil;
+	sc.tid = 0;
+	sc.status = "out of date";
+	unlock(&sc);
+	putsidecar(old);
+}
+
+void sidecarstats(void) {
+	Sidecar *s;
+	char *status;
+	uvlong inodehits, namehits;
+
+	if (sidecarpath == nil) {
+		return;
+	}
+	lock(&sc);
+	status = sc.status;
+	inodehits = sc.inodehits;
+	namehits = sc.namehits;
+	unlock(&sc);
+	print("sidecar\t%s (%s)\n", sidecarpath, status);
+	s = getsidecar();
+	if (s != nil) {
+		print("sidecar index\t%ulld inodes, %ulld directories, %ulld entries\n", s->hdr->ninodes, s->hdr->ndirs, s->hdr->nents);
+		putsidecar(s);
+	}
+	print("sidecar hits\t%ulld inodes, %ulld names\n", inodehits, namehits);
+}
@@ -0,0 +1,338 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <thread.h>
+#include <9p.h>
+
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+// The stat cache holds the entries of recently read directories already
+// packed into 9P stat format, keyed by the directory's inum and shared by
+// every fid that reads the directory. The first read of a directory builds
+// the whole listing, and every read after that is a memcpy of the range of
+// entries it asks for. Directories are kept in LRU order within a memory
+// budget. Directories too big to fit in a quarter of it aren't cached, and
+// are read by streaming their entries instead. They're remembered as too big
+// though, so that opening one again doesn't scan it to find that out again.
+static struct {
+	Lock;
+
+	StatDir **hash;
+	int nhash;
+
+	// Most recently used first.
+	StatDir *head;
+	StatDir *tail;
+
+	uvlong size;
+	uvlong maxsize;
+	int count;
+
+	uvlong hits;
+	uvlong misses;
+	uvlong evictions;
+	uvlong toobig;
+} scache;
+
+void initstatcache(uvlong size) {
+	scache.maxsize = size;
+	scache.nhash = 256;
+	scache.hash = emalloc9p(scache.nhash*sizeof(StatDir*));
+}
+
+static int statdirhash(hammer2_tid_t inum) {
+	return inum % scache.nhash;
+}
+
+static void sdunlink(StatDir *d) {
+	if (d->prev != nil)
+		d->prev->next = d->next;
+	else
+		scache.head = d->next;
+	if (d->next != nil)
+		d->next->prev = d->prev;
+	else
+		scache.tail = d->prev;
+	d->prev = nil;
+	d->next = nil;
+}
+
+static void sdfront(StatDir *d) {
+	d->prev = nil;
+	d->next = scache.head;
+	if (scache.head != nil)
+		scache.head->prev = d;
+	scache.head = d;
+	if (scache.tail == nil)
+		scache.tail = d;
+}
+
+static void sdunhash(StatDir *d) {
+	StatDir **l;
+
+	for(l = &scache.hash[statdirhash(d->inum)]; *l != nil; l = &(*l)->hnext) {
+		if (*l == d) {
+			*l = d->hnext;
+			break;
+		}
+	}
+	d->hnext = nil;
+}
+
+// What d costs against the budget.
+static long sdcost(StatDir *d) {
+	return d->big ? sizeof(StatDir) : d->size;
+}
+
+static void sdfree(StatDir *d) {
+	free(d->data);
+	free(d->offs);
+	free(d->keys);
+	free(d);
+}
+
+// Removes d from the cache. It's freed now if nobody is using it, or by
+// putstatdir when the last user is done with it otherwise. Must be called
+// with scache locked.
+static void sdremove(StatDir *d) {
+	sdunhash(d);
+	sdunlink(d);
+	scache.size -= sdcost(d);
+	scache.count--;
+	d->removed = 1;
+	if (d->ref == 0)
+		sdfree(d);
+}
+
+typedef struct {
+	DirEnts;
+	// The size the entries will take packed, which is known from their
+	// names without loading their inodes, and the most they can take.
+	long size;
+	long max;
+	int userlen;
+	int toobig;
+} Collect;
+
+static int collectdirent(hammer2_blockref_t *block, void *aux) {
+	Collect *c = aux;
+
+	if (block->type != HAMMER2_BREF_TYPE_DIRENT) {
+		return 1;
+	}
+	// The uid and gid are both the user, and there's no muid.
+	c->size += STATFIXLEN + block->embed.dirent.namlen + 2*c->userlen;
+	if (c->size > c->max) {
+		c->toobig = 1;
+		return 0;
+	}
+	if (c->cap == c->count) {
+		c->cap = c->cap == 0 ? 16 : c->cap*2;
+		c->entry = erealloc9p(c->entry, c->cap*sizeof(hammer2_blockref_t));
+	}
+	c->entry[c->count++] = *block;
+	return 1;
+}
+
+// Packs the stat entries of the directory entries in de into a new StatDir.
+// Returns nil if any of them couldn't be loaded, or with *toobig set if they
+// take more than max bytes.
+static StatDir* buildstatdir(hammer2_tid_t inum, DirEnts *de, long max, int *toobig) {
+	StatDir *d;
+	hammer2_tid_t *inums;
+	Arena ar;
+	Dir dir;
+	char *user;
+	long cap;
+	int i, n;
+
+	// Load all of the inodes at once in disk order first.
+	if (de->count > 0) {
+		initarena(&ar);
+		inums = arenaalloc(&ar, de->count*sizeof(hammer2_tid_t));
+		for(i = 0; i < de->count; i++)
+			inums[i] = de->entry[i].embed.dirent.inum;
+		prefetchattrs(inums, de->count);
+		freearena(&ar);
+	}
+
+	user = getuser();
+	d = emalloc9p(sizeof(StatDir));
+	d->inum = inum;
+	d->offs = emalloc9p((de->count+1)*sizeof(long));
+	d->keys = emalloc9p((de->count+1)*sizeof(hammer2_key_t));
+	cap = 0;
+	for(i = 0; i < de->count; i++) {
+		memset(&dir, 0, sizeof(Dir));
+		if (direntstat(&de->entry[i], &dir) < 0) {
+			sdfree(d);
+			return nil;
+		}
+		dir.uid = user;
+		dir.gid = user;
+		n = sizeD2M(&dir);
+		if (d->size + n > max) {
+			// It was estimated wrong, so give up rather than go
+			// over the budget.
+			free(dir.name);
+			sdfree(d);
+			*toobig = 1;
+			return nil;
+		}
+		if (d->size + n > cap) {
+			cap = cap == 0 ? 8192 : cap*2;
+			if (cap < d->size + n)
+				cap = d->size + n;
+			d->data = erealloc9p(d->data, cap);
+		}
+		convD2M(&dir, d->data + d->size, n);
+		free(dir.name);
+		d->keys[d->count] = de->entry[i].key;
+		d->offs[d->count++] = d->size;
+		d->size += n;
+	}
+	d->offs[d->count] = d->size;
+	return d;
+}
+
+// Adds d to the cache in place of anything already cached for its directory,
+// evicting the least recently used directories to make room for it. Must be
+// called with scache locked.
+static void sdinsert(StatDir *d) {
+	StatDir *prev;
+
+	for(prev = scache.hash[statdirhash(d->inum)]; prev != nil; prev = prev->hnext) {
+		if (prev->inum == d->inum) {
+			// Someone else got here first.
+			sdremove(prev);
+			break;
+		}
+	}
+	for(prev = scache.tail; prev != nil && scache.size + sdcost(d) > scache.maxsize; prev = scache.tail) {
+		scache.evictions++;
+		sdremove(prev);
+	}
+	d->hnext = scache.hash[statdirhash(d->inum)];
+	scache.hash[statdirhash(d->inum)] = d;
+	sdfront(d);
+	scache.size += sdcost(d);
+	scache.count++;
+}
+
+// Returns the packed stat entries of the directory dir, building them if they
+// aren't cached. The caller must release it with putstatdir. Returns nil if
+// the directory is too big to cache or couldn't be loaded, in which case it
+// needs to be read a batch of entries at a time.
+StatDir* getstatdir(hammer2_tid_t inum, inode *dir) {
+	StatDir *d;
+	Collect c;
+	char *err;
+
+	lock(&scache);
+	for(d = scache.hash[statdirhash(inum)]; d != nil; d = d->hnext) {
+		if (d->inum == inum) {
+			sdunlink(d);
+			sdfront(d);
+			if (d->big) {
+				scache.toobig++;
+				unlock(&scache);
+				return nil;
+			}
+			d->ref++;
+			scache.hits++;
+			unlock(&scache);
+			return d;
+		}
+	}
+	scache.misses++;
+	unlock(&scache);
+
+	// Stop looking as soon as the entries obviously won't fit, before
+	// any of their inodes are loaded.
+	memset(&c, 0, sizeof(Collect));
+	c.max = scache.maxsize/4;
+	c.userlen = strlen(getuser());
+	err = scanfrom(dir->u.blockset.blockref, HAMMER2_SET_COUNT, HAMMER2_DIRHASH_VISIBLE, collectdirent, &c);
+	if (err != nil) {
+		fprint(2, "%s\n", err);
+		free(c.entry);
+		return nil;
+	}
+	d = nil;
+	if (!c.toobig) {
+		d = buildstatdir(inum, &c.DirEnts, c.max, &c.toobig);
+	}
+	free(c.entry);
+	if (d == nil && !c.toobig) {
+		// Don't remember anything about it, since it may just not
+		// have been loadable this time.
+		return nil;
+	}
+	if (d == nil) {
+		d = emalloc9p(sizeof(StatDir));
+		d->inum = inum;
+		d->big = 1;
+		lock(&scache);
+		scache.toobig++;
+		sdinsert(d);
+		unlock(&scache);
+		return nil;
+	}
+	d->ref = 1;
+
+	lock(&scache);
+	sdinsert(d);
+	unlock(&scache);
+	return d;
+}
+
+void putstatdir(StatDir *d) {
+	lock(&scache);
+	assert(d->ref > 0);
+	d->ref--;
+	if (d->ref == 0 && d->removed)
+		sdfree(d);
+	unlock(&scache);
+}
+
+// Adds a reference to d, which must already be referenced.
+void dupstatdir(StatDir *d) {
+	lock(&scache);
+	assert(d->ref > 0);
+	d->ref++;
+	unlock(&scache);
+}
+
+// Throws away every cached directory.
+void flushstatcache(void) {
+	lock(&scache);
+	while(scache.head != nil)
+		sdremove(scache.head);
+	unlock(&scache);
+}
+
+void statcachestats(void) {
+	uvlong size, maxsize, hits, misses, evictions, toobig;
+	int count;
+
+	lock(&scache);
+	size = scache.size;
+	maxsize = scache.maxsize;
+	count = scache.count;
+	hits = scache.hits;
+	misses = scache.misses;
+	evictions = scache.evictions;
+	toobig = scache.toobig;
+	unlock(&scache);
+
+	print("stat dirs\t%d (%ulld/%ulld bytes)\n", count, size, maxsize);
+	print("stat hits\t%ulld\n", hits);
+	print("stat misses\t%ulld\n", misses);
+	if (hits + misses > 0)
+		print("stat hit rate\t%ulld%%\n", hits*100/(hits+misses));
+	print("stat evictions\t%ulld\n", evictions);
+	print("stat too big\t%ulld\n", toobig);
+}
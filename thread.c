@@ -4,11 +4,230 @@
 #include <thread.h>
 #include <9p.h>
 
-/* FIXME: This hack shouldn't be required. We allocate some big things on the
-   stack in Srv, so we need a big stack. Srv should just queue and not
-   need the stack, a different thread with a more appropriate stack size should be
-   the one reading from the queue doing the heavy lifting instead of hacking up
-   threadpostmountsrv. */
+#include "uuid.h"
+#include "hammer2_disk.h"
+#include "hammer2.h"
+#include "9phammer.h"
+
+// The number of procs handling requests. If it's 0, every request is handled
+// by the lib9p service loop itself.
+int nworkers = 4;
+
+// Requests which may need to wait for the disk are handed to a pool of
+// worker procs instead of being handled in the service loop, so that a read
+// of a cold block doesn't hold up every other client's walks and stats, and
+// independent requests can use more than one processor. Per-fid state is
+// protected by the RWLock in each fid's Aux, and the shared caches by their
+// own locks. Every request holds the volume read locked while it's handled,
+// whichever proc handles it, so that it can't see the volume being reloaded.
+//
+// Requests wait for a worker in a weighted fair queue. Each user who attached
+// (there's no way to tell the clients of a posted service apart otherwise)
+// is a separate flow in each class of work, and each request is tagged with
+// the virtual time it would finish at if every flow that has work queued got
+// its class's weight worth of service. Workers always take the request with
+// the earliest tag, so a user streaming a big file only gets its share, and
+// walks and listings get through ahead of it.
+typedef struct Flow Flow;
+struct Flow {
+	char *uid;
+	uvlong finish[NPRIO];
+	Flow *next;
+};
+
+typedef struct Job Job;
+struct Job {
+	Req *r;
+	int prio;
+	uvlong tag;
+	Job *next;
+};
+
+static struct {
+	QLock;
+	Rendez nonempty;
+	// Sorted by tag.
+	Job *head;
+	uvlong vtime;
+	Flow *flows;
+
+	int depth[NPRIO];
+	uvlong done[NPRIO];
+
+	Srv *srv;
+	void (*start)(Srv*);
+	void (*handler[Tmax])(Req*);
+} pool;
+
+static void workerproc(void*) {
+	Job *j;
+	Req *r;
+
+	for(;;) {
+		qlock(&pool);
+		while(pool.head == nil)
+			rsleep(&pool.nonempty);
+		j = pool.head;
+		pool.head = j->next;
+		pool.vtime = j->tag;
+		pool.depth[j->prio]--;
+		pool.done[j->prio]++;
+		qunlock(&pool);
+
+		r = j->r;
+		setprio(j->prio);
+		free(j);
+		beginreq();
+		pool.handler[r->ifcall.type](r);
+		endreq();
+	}
+}
+
+// Must be called with pool locked.
+static Flow* getflow(char *uid) {
+	Flow *f;
+
+	if (uid == nil)
+		uid = "";
+	for(f = pool.flows; f != nil; f = f->next) {
+		if (strcmp(f->uid, uid) == 0)
+			return f;
+	}
+	f = emalloc9p(sizeof(Flow));
+	f->uid = estrdup9p(uid);
+	f->next = pool.flows;
+	pool.flows = f;
+	return f;
+}
+
+static void dispatch(Req *r) {
+	Job *j, **l;
+	Flow *f;
+	uvlong cost;
+
+	j = emalloc9p(sizeof(Job));
+	j->r = r;
+	j->prio = PMeta;
+	cost = 1;
+	if (r->ifcall.type == Tread && r->fid->qid.type != QTDIR) {
+		// File reads pay for what they read, a block at a time.
+		j->prio = PData;
+		cost += r->ifcall.count / HAMMER2_LBUFSIZE;
+	}
+	cost = cost*PRIOSCALE / prioweight(j->prio);
+
+	qlock(&pool);
+	f = getflow(r->fid->uid);
+	j->tag = f->finish[j->prio];
+	if (j->tag < pool.vtime)
+		j->tag = pool.vtime;
+	j->tag += cost;
+	f->finish[j->prio] = j->tag;
+	for(l = &pool.head; *l != nil && (*l)->tag <= j->tag; l = &(*l)->next)
+		;
+	j->next = *l;
+	*l = j;
+	pool.depth[j->prio]++;
+	rwakeup(&pool.nonempty);
+	qunlock(&pool);
+}
+
+void poolstats(void) {
+	int depth[NPRIO];
+	uvlong done[NPRIO];
+	int i;
+
+	qlock(&pool);
+	memcpy(depth, pool.depth, sizeof(depth));
+	memcpy(done, pool.done, sizeof(done));
+	qunlock(&pool);
+	for(i = 0; i < NPRIO; i++) {
+		if (depth[i] == 0 && done[i] == 0)
+			continue;
+		print("%s requests\t%ulld (%d waiting, weight %d)\n", prioname(i), done[i], depth[i], prioweight(i));
+	}
+}
+
+// lib9p only hands walk1 and clone to walkandclone inside the service loop,
+// so walks are done with the same wrappers it uses.
+static char* walk1(Fid *fid, char *name, void *v) {
+	Srv *s = v;
+	Qid q;
+	char *err;
+
+	err = s->walk1(fid, name, &q);
+	if (err != nil) {
+		return err;
+	}
+	fid->qid = q;
+	return nil;
+}
+
+static char* clone(Fid *old, Fid *new, void *v) {
+	Srv *s = v;
+
+	if (s->clone == nil) {
+		return nil;
+	}
+	return s->clone(old, new);
+}
+
+static void walk(Req *r) {
+	walkandclone(r, walk1, clone, pool.srv);
+}
+
+// Handles a request in the service loop.
+static void inloop(Req *r) {
+	beginreq();
+	pool.handler[r->ifcall.type](r);
+	endreq();
+}
+
+// Has the request type t handled by how if the server handles it with fn.
+static void handle(int t, void (*fn)(Req*), void (**srvfn)(Req*), void (*how)(Req*)) {
+	if (fn == nil) {
+		return;
+	}
+	pool.handler[t] = fn;
+	*srvfn = how;
+}
+
+// The workers are started by the service loop's proc once the server has
+// started, so that they share the file descriptors it opened.
+static void startworkers(Srv *s) {
+	int i;
+
+	if (pool.start != nil)
+		pool.start(s);
+	for(i = 0; i < nworkers; i++) {
+		proccreate(workerproc, nil, 512*1024);
+	}
+}
+
+static void initworkers(Srv *s) {
+	void (*how)(Req*);
+
+	pool.srv = s;
+	how = inloop;
+	if (nworkers > 0) {
+		pool.nonempty.l = &pool;
+		pool.start = s->start;
+		s->start = startworkers;
+		how = dispatch;
+	}
+	handle(Tattach, s->attach, &s->attach, inloop);
+	handle(Tread, s->read, &s->read, how);
+	handle(Tstat, s->stat, &s->stat, how);
+	handle(Topen, s->open, &s->open, how);
+	if (s->walk == nil && s->walk1 != nil)
+		handle(Twalk, walk, &s->walk, how);
+	else
+		handle(Twalk, s->walk, &s->walk, how);
+}
+
+/* The requests that aren't handed to the workers are still handled in the
+   service loop, and some of them (attach, and everything when nworkers is 0)
+   put big things on the stack, so it still needs a big stack. */
 static void
 tforker(void (*fn)(void*), void *arg, int rflag)
 {
@@ -18,7 +237,7 @@ tforker(void (*fn)(void*), void *arg, int rflag)
 void
 mythreadpostmountsrv(Srv *s, char *name, char *mtpt, int flag)
 {
+	initworkers(s);
 	_forker = tforker;
 	_postmountsrv(s, name, mtpt, flag);
 }
-